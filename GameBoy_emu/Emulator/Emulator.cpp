@@ -8,7 +8,7 @@
 int Emulator::ExecuteNextOpcode()
 {
     int cycles{};
-    BYTE opcode = m_Rom[m_ProgramCounter];
+    BYTE opcode = GetMemory(m_ProgramCounter);
 
     if ((m_ProgramCounter >= 0x4000 && m_ProgramCounter <= 0x7FFF) || (m_ProgramCounter >= 0xA000 && m_ProgramCounter <= 0xBFFF))
         opcode = ReadMemory(m_ProgramCounter);
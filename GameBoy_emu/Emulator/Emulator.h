@@ -1,9 +1,17 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <string_view>
 #include <array>
+#include <atomic>
+#include <bitset>
+#include <deque>
+#include <thread>
 #include <utility>
+#include <vector>
+
+#include "Misc/SpscQueue.h"
 
 #ifndef MY_NGTEST
 #include <gtest/gtest.h>
@@ -17,6 +25,30 @@ using SIGNED_WORD = int16_t;
 
 struct SDL_Renderer;
 
+// Layout of the pixels the emulator writes into the frame buffer.
+// Rows are always stored top to bottom, `pitch` bytes apart
+enum class PixelFormat
+{
+	RGBA8888,	// 4 bytes per pixel: R, G, B, A in memory order
+	RGB565,		// one native endian 16 bit word per pixel
+	SHADE8,		// 1 byte per pixel: 0 (white) to 3 (black)
+	PACKED2BPP,	// 4 shades per byte, leftmost pixel in bits 7-6
+};
+
+// How the picture is produced
+enum class PpuBackend
+{
+	SCANLINE,	// whole lines at once from cached layers, fixed mode lengths (fast)
+	FIFO,		// dot by dot through the pixel FIFO, variable mode 3 length (accurate)
+};
+
+// What the PPU does besides keeping time
+enum class VideoMode
+{
+	FULL,			// draws every line into the frame buffer
+	TIMING_ONLY,	// LY, STAT and interrupts as usual, no pixels
+};
+
 class Emulator 
 {
 public:
@@ -26,20 +58,166 @@ public:
 	void Update();
 	void LoadGame(std::string_view path);
 	Emulator();
+	~Emulator();
 	void KeyPressed(int key);
 	void KeyReleased(int key);
-	friend void DrawGraphics(SDL_Renderer*& renderer, const Emulator& emu);
+
+	// Presses or releases `key` right before the first instruction that starts
+	// at or after emulated cycle `cycle`, interrupt included, however the
+	// calls line up with Update(). Events for the same cycle keep their order
+	void QueueInput(uint64_t cycle, int key, bool pressed);
+	// Bit k set for every key held once everything queued has happened
+	uint8_t GetHeldButtons() const;
+	// Queues, for right now, the presses and releases that make `mask` the
+	// buttons held, in the bits GetHeldButtons() uses
+	void SetHeldButtons(uint8_t mask);
+	// T-cycles run since the emulator was created
+	uint64_t GetCycleCount() const;
+	// what the CPU would read at `address` right now, without changing anything
+	BYTE PeekMemory(WORD address) const;
+
+	// Points the emulator at a 160x144 target it writes every finished
+	// scanline into. pixels == nullptr goes back to the internal buffer
+	void SetFrameBuffer(void* pixels, int pitch, PixelFormat format);
+	const BYTE* GetFrameBuffer() const;
+	int GetFramePitch() const;
+	PixelFormat GetPixelFormat() const;
+	static int GetRowBytes(PixelFormat format);
+
+	// Takes effect at the next frame boundary (the start of vertical blank),
+	// straight away if the LCD is off or already in vertical blank,
+	// which is where Update() returns. The frame buffer keeps the last drawn frame
+	void SetVideoMode(VideoMode mode);
+	VideoMode GetVideoMode() const;
+
+	// Lines of the frame the last Update() drew that differ from
+	// the frame before it. Frames that aren't drawn change nothing
+	const std::bitset<144>& GetDirtyRows() const;
+
+	// RenderThread.cpp
+	// Renders scanlines on a separate thread from a log of the video writes
+	// the CPU made. Update() still returns with the frame finished
+	void SetRenderThread(bool enabled);
+	bool IsRenderThreadEnabled() const;
+
+	// PixelFifo.cpp
+	// The FIFO backend always draws on the CPU thread,
+	// selecting it turns the render thread off
+	void SetPpuBackend(PpuBackend backend);
+	PpuBackend GetPpuBackend() const;
+
+	// Snapshot.cpp
+	// Everything a running game can change, copied out and back in as is.
+	// Settings (backend, video mode, frame buffer) aren't part of it
+	struct Snapshot;
+	void TakeSnapshot(Snapshot& snapshot) const;
+	void RestoreSnapshot(const Snapshot& snapshot);
+
+	// A new emulator in the same state, sharing the cartridge and any page
+	// of memory or cartridge RAM neither of them has written to since.
+	// Settings are copied but the child draws into its own buffer (allocated
+	// once it draws something) and has no render thread
+	std::unique_ptr<Emulator> Fork();
+
+	// Back to the state LoadGame() left it in, which is kept (and shared
+	// with forks) for this, so it's a few copies with no file or allocation.
+	// Does nothing if no game was loaded
+	void Reset();
+	// RestoreSnapshot(), also forgetting the last frame drawn, so the
+	// next one comes out whole the way it does on a new emulator
+	void ResetTo(const Snapshot& snapshot);
+
+	// A snapshot as a block of bytes for keeping on disk. Only loads into
+	// the same build of the emulator (the version) running the same game,
+	// and not at all if anything in it is out of range. `snapshot` is only
+	// written to if it loads
+	void SaveState(const Snapshot& snapshot, std::vector<BYTE>& data) const;
+	bool LoadState(const BYTE* data, size_t size, Snapshot& snapshot) const;
+	// FNV-1a of the cartridge as loaded
+	uint64_t GetRomHash() const;
+	// Hash of memory, cartridge RAM, the registers and the cycle count.
+	// Two runs that went apart show up here within a frame or so
+	uint64_t GetStateHash() const;
+
+	// Lockstep.cpp
+	// Experimental: Update() on `count` emulators at once, up to
+	// LOCKSTEP_LANES at a time. Their registers are kept side by side, one
+	// 16 bit slot of an AVX2 register per emulator (lane), and lanes about
+	// to run the same ROM instruction run it together when it's one of the
+	// common ones. Memory is still read and written lane by lane, and
+	// everything else runs the usual way. Every lane ends up exactly where
+	// Update() would have left it. Without AVX2 it's just Update() on each.
+	// No fast path: so far it runs 5-20% slower than Update() on each lane
+	// (per-lane timers and PPU outweigh the shared instructions)
+	static constexpr int LOCKSTEP_LANES{ 16 };
+	struct LockstepCounts
+	{
+		uint64_t steps;		// instructions (halted ones included) over all lanes
+		uint64_t together;	// how many of them ran together with other lanes
+	};
+	static LockstepCounts UpdateLockstep(Emulator* const* lanes, int count);
 
 #ifndef MY_NGTEST
 	FRIEND_TEST(EmulatorTest, Foo);
 	FRIEND_TEST(EmulatorTest, CPUTest);
+	FRIEND_TEST(EmulatorTest, PaletteTables);
+	FRIEND_TEST(EmulatorTest, SpriteLines);
+	FRIEND_TEST(EmulatorTest, FrameBufferFormats);
+	FRIEND_TEST(EmulatorTest, LayerCache);
+	FRIEND_TEST(EmulatorTest, RenderThread);
+	FRIEND_TEST(EmulatorTest, PixelFifo);
+	FRIEND_TEST(EmulatorTest, TimingOnly);
+	FRIEND_TEST(EmulatorTest, DirtyRows);
+	FRIEND_TEST(EmulatorTest, InputQueue);
+	FRIEND_TEST(EmulatorTest, Snapshot);
+	FRIEND_TEST(EmulatorTest, SaveState);
+	FRIEND_TEST(EmulatorTest, Fork);
+	FRIEND_TEST(EmulatorTest, Movie);
+	FRIEND_TEST(EmulatorTest, Reset);
 	friend std::map<char, bool> GetFlags(const Emulator& emu);
 #endif // !MY_NGTEST
 
 private:
-	std::unique_ptr<BYTE[]> m_CartridgeMemory{};
-	BYTE m_ScreenData[160][144][3] = { 255 };
-	BYTE m_Rom[0x10000] = {0};
+	// never written after loading, forks share it
+	std::shared_ptr<BYTE[]> m_CartridgeMemory{};
+	uint64_t m_RomHash{};
+	// the state right after LoadGame(), for Reset()
+	std::shared_ptr<const Snapshot> m_LoadedSnapshot{};
+
+	// internal RGBA8888 frame, used until the caller supplies a buffer,
+	// allocated when the first line is drawn into it
+	std::unique_ptr<BYTE[]> m_OwnedFrame{};
+	BYTE* m_FrameBuffer{};
+	int m_FramePitch{};
+	PixelFormat m_PixelFormat{ PixelFormat::RGBA8888 };
+
+	// value stored for each shade in the current pixel format
+	uint32_t m_FormatColours[4]{};
+
+	// shades of the scanline being drawn, written out when it's done
+	BYTE m_LineShades[160]{};
+
+	// shades of every line as last drawn, allocated with the first line
+	// drawn, until then all of the frame counts as changed
+	std::unique_ptr<BYTE[]> m_LastShades{};
+
+	// lines changed so far this frame, and in the last finished one
+	std::bitset<144> m_DirtyRows{};
+	std::bitset<144> m_FrameDirtyRows{};
+
+	// Memory comes in 1KB pages that can be shared between instances
+	// (forks) until either side writes to them
+	static constexpr int RAM_PAGE_SIZE{ 0x400 };
+	struct RamPage
+	{
+		BYTE bytes[RAM_PAGE_SIZE];
+	};
+
+	// the 64KB the CPU sees, as stored (the switchable ROM bank and the
+	// cartridge RAM come from elsewhere). A page this instance may write
+	// to has its bit set
+	std::array<std::shared_ptr<RamPage>, 0x10000 / RAM_PAGE_SIZE> m_MemoryPages{};
+	uint64_t m_OwnedMemoryPages{};
 
 	union Register
 	{
@@ -97,9 +275,13 @@ private:
 	const int FLAG_C{ 4 };
 
 	int m_CurrentROMBank{ 1 };
-	BYTE m_RAMBanks[0x8000] = {0};
 	BYTE m_CurrentRAMBank{};
 
+	// the 4 cartridge RAM banks in pages, all pointing at one shared
+	// page of zeros to start with
+	std::array<std::shared_ptr<RamPage>, 0x8000 / RAM_PAGE_SIZE> m_RAMPages{};
+	uint32_t m_OwnedRAMPages{};
+
 	bool m_MBC1{};
 	bool m_MBC2{};
 	bool m_EnableRAM{}; // possible bug
@@ -121,6 +303,18 @@ private:
 
 	BYTE m_JoypadState{ 0xFF };
 
+	uint64_t m_TotalCycles{};
+
+	struct InputEvent
+	{
+		uint64_t cycle;
+		int key;
+		bool pressed;
+	};
+
+	// waiting to be applied, in cycle order
+	std::deque<InputEvent> m_InputQueue{};
+
 	enum COLOUR
 	{
 		WHITE,
@@ -129,6 +323,136 @@ private:
 		BLACK,
 	};
 
+	// grey level of every COLOUR on screen
+	static constexpr BYTE SHADE_VALUES[4]{ 0xFF, 0xCC, 0x77, 0x00 };
+
+	enum PALETTE
+	{
+		BGP,
+		OBP0,
+		OBP1,
+	};
+
+	// shade (COLOUR) of each colour id for BGP, OBP0 and OBP1,
+	// rebuilt whenever 0xFF47-0xFF49 is written
+	BYTE m_Palettes[3][4]{};
+
+	// OAM indices of the (at most 10) sprites drawn on a line,
+	// highest priority first
+	struct SpriteLine
+	{
+		BYTE count;
+		BYTE sprites[10];
+	};
+
+	// rebuilt only after OAM or the sprite size (LCDC bit 2) changed
+	SpriteLine m_SpriteLines[144]{};
+	bool m_SpritesDirty{ true };
+
+	// Both tile maps (0x9800 and 0x9C00) drawn out as 256x256 colour id
+	// bitmaps. A cell is redrawn when its map entry points at another tile
+	// or that tile's version changed. Rows of cells are only rechecked
+	// after VRAM was written, so lines are mostly plain copies
+	struct LayerCache
+	{
+		BYTE pixels[2][256 * 256];
+		WORD cellTiles[2][1024];	// tile address each cell was drawn from, 0 = never
+		uint32_t cellVersions[2][1024];
+		uint32_t rowGenerations[2][32];	// m_VramGeneration the row was checked at
+	};
+
+	// allocated on the first rendered line
+	std::unique_ptr<LayerCache> m_LayerCache{};
+
+	// bumped on every write to a tile in 0x8000-0x97FF
+	uint32_t m_TileVersions[384]{};
+
+	// bumped on every VRAM write and tile data area switch
+	uint32_t m_VramGeneration{ 1 };
+
+	// what the CPU thread tells the render thread
+	enum VIDEO_EVENT : BYTE
+	{
+		VIDEO_WRITE,	// address = data
+		VIDEO_LINE,		// render scanline `address`
+		VIDEO_SYNC,		// frame done, let Update() return
+		VIDEO_STOP,
+	};
+
+	struct VideoEvent
+	{
+		WORD address;
+		BYTE data;
+		BYTE kind;
+	};
+
+	std::unique_ptr<SpscQueue<VideoEvent, 1 << 16>> m_VideoLog{};
+	// the render thread's own flat copy of the memory, it renders from
+	// that while it runs
+	std::unique_ptr<BYTE[]> m_RenderShadow{};
+	std::thread m_RenderThread{};
+	std::atomic<uint32_t> m_VideoSignal{};	// bumped for every line queued
+	std::atomic<uint32_t> m_VideoSynced{};	// last VIDEO_SYNC rendered
+	uint32_t m_VideoSyncs{};
+
+	PpuBackend m_PpuBackend{ PpuBackend::SCANLINE };
+
+	VideoMode m_VideoMode{ VideoMode::FULL };
+	VideoMode m_PendingVideoMode{ VideoMode::FULL };
+
+	// set when vertical blank starts, Update() runs until then
+	bool m_FrameDone{};
+	// cycles in a frame, for when the LCD is off and there's no vblank to stop at
+	static constexpr int FRAME_CYCLES{ 70224 };
+
+	// sprite pixel waiting in the FIFO, colour 0 = nothing there
+	struct FifoSprite
+	{
+		BYTE colour;
+		BYTE palette;
+		bool behindBackground;
+	};
+
+	// everything the FIFO backend keeps between dots
+	struct FifoState
+	{
+		int dot;				// 0-455 within the current line
+		int mode;				// what the STAT mode bits say
+		bool lcdOff;
+
+		int x;					// next pixel to go out on the line
+		int discard;			// pixels still to drop for SCX & 7 / WX < 7
+		int delay;				// dots left of the dummy fetch at the start of mode 3
+
+		// background/window fetcher
+		int fetchStep;			// tile, data low, data high, push
+		int fetchDots;
+		int fetchX;				// tile column, relative to SCX or the window
+		BYTE fetchTile;
+		BYTE fetchLow;
+		BYTE fetchHigh;
+		bool window;			// fetching window tiles on this line
+
+		BYTE background[8];		// colour ids, only refilled once empty
+		int backgroundHead;
+		int backgroundCount;
+
+		FifoSprite sprites[8];	// slot (spriteHead + i) & 7 is pixel x + i
+		int spriteHead;
+
+		// sprites picked by the OAM scan, in OAM order
+		BYTE lineSprites[10];
+		int lineSpriteCount;
+		int spritesFetched;		// bit per lineSprites entry
+		int spriteFetch;		// lineSprites index being fetched, -1 = none
+		int spriteDots;
+
+		int windowLine;			// window lines drawn so far this frame
+		bool windowTriggered;	// LY matched WY this frame
+	};
+
+	FifoState m_Fifo{};
+
 	// Memory.cpp
 	void WriteMemory(WORD address, BYTE data);
 	BYTE ReadMemory(WORD address) const;
@@ -138,6 +462,27 @@ private:
 	void DoChangeHiRomBank(BYTE data);
 	void DoRAMBankChange(BYTE data);
 	void DoChangeROMRAMMode(BYTE data);
+	// copies the page first if it's shared
+	RamPage& GetWritableRamPage(int page);
+	RamPage& GetWritableMemoryPage(int page);
+
+	// The byte stored at `address`, nothing worked out (see ReadMemory()
+	// for that), and the same for writing. Used all over, so defined here
+	BYTE GetMemory(WORD address) const
+	{
+		return m_MemoryPages[address / RAM_PAGE_SIZE]->bytes[address % RAM_PAGE_SIZE];
+	}
+	BYTE& GetWritableMemory(WORD address)
+	{
+		int page = address / RAM_PAGE_SIZE;
+		if (((m_OwnedMemoryPages >> page) & 1) == 0)
+			return GetWritableMemoryPage(page).bytes[address % RAM_PAGE_SIZE];
+		return m_MemoryPages[page]->bytes[address % RAM_PAGE_SIZE];
+	}
+
+	// Snapshot.cpp
+	// whether a save state only holds values a running game can end up with
+	static bool IsValidState(const BYTE* state, const BYTE* inputs, uint32_t inputCount);
 
 	// Timers.cpp
 	void UpdateTimers(int cycles);
@@ -166,14 +511,61 @@ private:
 
 	// Graphics.cpp
 	void UpdateGraphics(int cycles);
+	void StartVBlank();
 	void DrawScanLine();
-	void RenderTiles(BYTE lcdControl);
-	void RenderSprites(BYTE lcdControl);
-	COLOUR GetColour(BYTE colourNum, WORD address) const;
+	void RenderScanLine(int line);
+	void RenderTiles(BYTE lcdControl, int line);
+	void CopyLayerLine(BYTE* colourIds, int begin, int end, int map,
+		WORD tileData, bool unsig, BYTE xPos, BYTE yPos);
+	void UpdateLayerCell(int map, int cell, WORD tileData, bool unsig);
+	void RenderSprites(BYTE lcdControl, int line);
+	void BuildSpriteLines(BYTE lcdControl);
+	void UpdatePalette(WORD address);
+	void OutputScanLine(int line);
+	void VideoWrite(WORD address, BYTE data);
+	void ApplyVideoWrite(WORD address, BYTE data);
+	// where the renderer reads VRAM, OAM and the LCD registers: the memory
+	// itself, or the render thread's copy of it. No tile, tile map row or
+	// sprite entry crosses a page, so each can be read from one pointer
+	const BYTE* GetRenderMemory(WORD address) const;
+	// allocates the internal frame if that's what is being drawn into
+	BYTE* GetFrameRow(int line);
+
+	// PixelFifo.cpp
+	void UpdateFifo(int cycles);
+	void StepFifo();
+	void StartFifoLine();
+	void StartFifoMode3();
+	void StepFifoMode3(int line);
+	void StepFifoFetcher(int line);
+	void FetchFifoSprite(int index, int line);
+	void SetFifoMode(int mode);
+	void CompareFifoLYC();
+
+	// RenderThread.cpp
+	void PushVideoEvent(BYTE kind, WORD address, BYTE data);
+	void SyncRenderThread();
+	void RenderThreadLoop();
 
 	// Joypad.cpp
 	BYTE GetJoypadState() const;
 
+	// PublicFunctions.cpp
+	// the queued input that's due, pressed or released
+	void ApplyDueInput();
+	// what Update() does once the frame is done
+	void FinishUpdate();
+
+	// Lockstep.cpp
+	// AF, BC, DE, HL, SP and PC, one row of lanes each
+	using LockstepRegisters = WORD[6][LOCKSTEP_LANES];
+	// runs the instruction (opcode, then nn) every lane in `group` is at,
+	// false if it isn't one lanes run together
+	static bool StepLockstepGroup(Emulator* const* lanes, uint32_t group, LockstepRegisters& regs,
+		BYTE opcode, WORD nn, int& cycles);
+	void LoadLockstepLane(const LockstepRegisters& regs, int lane);
+	void StoreLockstepLane(LockstepRegisters& regs, int lane) const;
+
 	// Emulator.cpp
 	int ExecuteNextOpcode();
 	int ExecuteOpcode(BYTE opcode);
@@ -215,4 +607,33 @@ private:
 	void CPU_JUMP_IMMEDIATE(bool useCondition, int flag, bool condition);
 	void CPU_CALL(bool useCondition, int flag, bool condition);
 	void CPU_RETURN(bool useCondition, int flag, bool condition);
-};
\ No newline at end of file
+};
+
+// The cartridge ROM never changes, so it isn't in here. About 97KB,
+// better kept on the heap
+struct Emulator::Snapshot
+{
+	// everything with a fixed size, one flat block a save state copies as is
+	struct State
+	{
+		BYTE memory[0x10000];
+		BYTE ramBanks[0x8000];
+
+		WORD af, bc, de, hl, pc, sp;
+
+		int currentROMBank;
+		BYTE currentRAMBank;
+		bool mbc1, mbc2, enableRAM, romBanking;
+
+		int timerCounter, dividerCounter;
+		bool interuptMaster, pendingInteruptDisabled, pendingInteruptEnabled, halted;
+
+		int scanlineCounter;
+		FifoState fifo;
+
+		BYTE joypadState;
+		uint64_t totalCycles;
+	} state;
+
+	std::vector<InputEvent> inputs;
+};
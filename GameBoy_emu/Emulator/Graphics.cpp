@@ -1,8 +1,18 @@
 #include "Emulator.h"
 #include "Misc/BitOps.h"
+#include "Misc/PixelKernels.h"
+
+#include <algorithm>
+#include <cstring>
 
 void Emulator::UpdateGraphics(int cycles)
 {
+    if (m_PpuBackend == PpuBackend::FIFO)
+    {
+        UpdateFifo(cycles);
+        return;
+    }
+
     SetLCDStatus();
 
     if (IsLCDEnabled())
@@ -13,18 +23,18 @@ void Emulator::UpdateGraphics(int cycles)
     if (m_ScanlineCounter <= 0)
     {
         // time to move onto next scanline
-        m_Rom[0xFF44]++;
+        GetWritableMemory(0xFF44)++;
         BYTE currentline = ReadMemory(0xFF44);
 
         m_ScanlineCounter = 456;
 
         // we have entered vertical blank period
         if (currentline == 144)
-            RequestInterupt(0);
+            StartVBlank();
 
         // if gone past scanline 153 reset to 0
         else if (currentline > 153)
-            m_Rom[0xFF44] = 0;
+            GetWritableMemory(0xFF44) = 0;
 
             // draw the current scanline
         else if (currentline < 144)
@@ -32,38 +42,66 @@ void Emulator::UpdateGraphics(int cycles)
     }
 }
 
+void Emulator::StartVBlank()
+{
+    RequestInterupt(0);
+
+    // the frame is over, a different video mode can start with the next one
+    m_VideoMode = m_PendingVideoMode;
+    m_FrameDone = true;
+}
+
 void Emulator::DrawScanLine()
 {
-    BYTE control = ReadMemory(0xFF40);
+    BYTE currentline = ReadMemory(0xFF44);
+
+    // safety check to make sure what im about
+    // to set is int the 160x144 bounds
+    if (currentline > 143)
+        return;
+
+    if (m_VideoMode == VideoMode::TIMING_ONLY)
+        return;
+
+    if (m_VideoLog)
+        PushVideoEvent(VIDEO_LINE, currentline, 0);
+    else
+        RenderScanLine(currentline);
+}
+
+void Emulator::RenderScanLine(int line)
+{
+    BYTE control = *GetRenderMemory(0xFF40);
+
+    // with the background off the line is blank
     if (TestBit(control, 0))
-        RenderTiles(control);
+        RenderTiles(control, line);
+    else
+        std::fill_n(m_LineShades, 160, WHITE);
 
     if (TestBit(control, 1))
-        RenderSprites(control);
+        RenderSprites(control, line);
+
+    OutputScanLine(line);
 }
 
-void Emulator::RenderTiles(BYTE lcdControl)
+void Emulator::RenderTiles(BYTE lcdControl, int line)
 {
     WORD tileData = 0;
-    WORD backgroundMemory = 0;
     bool unsig = true;
 
     // where to draw the visual area and the window
-    BYTE scrollY = ReadMemory(0xFF42);
-    BYTE scrollX = ReadMemory(0xFF43);
-    BYTE windowY = ReadMemory(0xFF4A);
-    BYTE windowX = ReadMemory(0xFF4B) - 7;
-
-    bool usingWindow = false;
-
-    // is the window enabled?
-    if (TestBit(lcdControl, 5))
-    {
-        // is the current scanline we're drawing
-        // within the windows Y pos?,
-        if (windowY <= ReadMemory(0xFF44))
-            usingWindow = true;
-    }
+    BYTE scrollY = *GetRenderMemory(0xFF42);
+    BYTE scrollX = *GetRenderMemory(0xFF43);
+    BYTE windowY = *GetRenderMemory(0xFF4A);
+    int windowX = *GetRenderMemory(0xFF4B) - 7;
+    BYTE currentline = line;
+
+    // the background covers the line up to the point
+    // where the window starts, if the window is on this line
+    int windowStart = 160;
+    if (TestBit(lcdControl, 5) && (windowY <= currentline) && (windowX < 160))
+        windowStart = windowX < 0 ? 0 : windowX;
 
     // which tile data are we using?
     if (TestBit(lcdControl, 4))
@@ -78,246 +116,306 @@ void Emulator::RenderTiles(BYTE lcdControl)
         unsig = false;
     }
 
-    // which background mem?
-    if (false == usingWindow)
+    if (!m_LayerCache)
+        m_LayerCache = std::make_unique<LayerCache>();
+
+    // colour ids (0-3) of the whole line, copied out of the cached layers
+    BYTE colourIds[160];
+
+    if (windowStart > 0)
     {
-        if (TestBit(lcdControl, 3))
-            backgroundMemory = 0x9C00;
-        else
-            backgroundMemory = 0x9800;
+        int backgroundMap = TestBit(lcdControl, 3) ? 1 : 0;
+        CopyLayerLine(colourIds, 0, windowStart, backgroundMap, tileData, unsig,
+            scrollX, scrollY + currentline);
     }
-    else
+
+    if (windowStart < 160)
     {
-        // which window memory?
-        if (TestBit(lcdControl, 6))
-            backgroundMemory = 0x9C00;
-        else
-            backgroundMemory = 0x9800;
+        int windowMap = TestBit(lcdControl, 6) ? 1 : 0;
+        CopyLayerLine(colourIds, windowStart, 160, windowMap, tileData, unsig,
+            windowStart - windowX, currentline - windowY);
     }
 
-    BYTE yPos = 0;
+    // now we have the colour ids get the actual
+    // colours from palette 0xFF47
+    GetPixelKernels().MapPalette(colourIds, m_LineShades, 160, m_Palettes[BGP]);
+}
+
+void Emulator::CopyLayerLine(BYTE* colourIds, int begin, int end, int map,
+    WORD tileData, bool unsig, BYTE xPos, BYTE yPos)
+{
+    // bring the row of tiles up to date if VRAM changed since it was last checked
+    uint32_t& rowGeneration = m_LayerCache->rowGenerations[map][yPos / 8];
+    if (rowGeneration != m_VramGeneration)
+    {
+        for (int col = 0; col < 32; col++)
+            UpdateLayerCell(map, (yPos / 8) * 32 + col, tileData, unsig);
+        rowGeneration = m_VramGeneration;
+    }
 
-    // yPos is used to calculate which of 32 vertical tiles the
-    // current scanline is drawing
-    if (!usingWindow)
-        yPos = scrollY + ReadMemory(0xFF44);
+    // the layer wraps around at 256 pixels, so this is
+    // one copy, or two when the span crosses the right edge
+    const BYTE* row = &m_LayerCache->pixels[map][yPos * 256];
+    int count = end - begin;
+    int first = std::min(count, 256 - xPos);
+    std::copy_n(row + xPos, first, colourIds + begin);
+    std::copy_n(row, count - first, colourIds + begin + first);
+}
+
+void Emulator::UpdateLayerCell(int map, int cell, WORD tileData, bool unsig)
+{
+    // deduce where this tile identifier is in memory.
+    // Remember it can be signed or unsigned
+    BYTE tileNum = *GetRenderMemory((map ? 0x9C00 : 0x9800) + cell);
+    WORD tileLocation = tileData;
+    if (unsig)
+        tileLocation += tileNum * 16;
     else
-        yPos = ReadMemory(0xFF44) - windowY;
+        tileLocation += ((SIGNED_BYTE)tileNum + 128) * 16;
+
+    // still the same tile, and nobody wrote to it since it was drawn?
+    uint32_t version = m_TileVersions[(tileLocation - 0x8000) / 16];
+    LayerCache& cache = *m_LayerCache;
+    if ((cache.cellTiles[map][cell] == tileLocation) && (cache.cellVersions[map][cell] == version))
+        return;
+
+    // the 8 rows of a tile are 8 consecutive bitplane pairs,
+    // so they decode in one go like a line of 8 tiles
+    BYTE colourIds[64];
+    GetPixelKernels().DecodeTileRows(GetRenderMemory(tileLocation), colourIds, 8);
 
-    // which of the 8 vertical pixels of the current
-    // tile is the scanline on?
-    WORD tileRow = (((BYTE)(yPos / 8)) * 32);
+    BYTE* pixels = &cache.pixels[map][(cell / 32) * 8 * 256 + (cell % 32) * 8];
+    for (int line = 0; line < 8; line++)
+        std::copy_n(colourIds + line * 8, 8, pixels + line * 256);
 
-    // time to start drawing the 160 horizontal pixels
-    // for this scanline
-    for (int pixel = 0; pixel < 160; pixel++)
+    cache.cellTiles[map][cell] = tileLocation;
+    cache.cellVersions[map][cell] = version;
+}
+
+void Emulator::RenderSprites(BYTE lcdControl, int scanline)
+{
+    if (m_SpritesDirty)
+        BuildSpriteLines(lcdControl);
+
+    int ysize = TestBit(lcdControl, 2) ? 16 : 8;
+    const SpriteLine& sprites = m_SpriteLines[scanline];
+
+    // draw the lowest priority sprite first so the
+    // higher priority ones end up on top of it
+    for (int i = sprites.count - 1; i >= 0; i--)
     {
-        BYTE xPos = pixel + scrollX;
+        // sprite occupies 4 bytes in the sprite attributes table
+        const BYTE* oam = GetRenderMemory(0xFE00 + sprites.sprites[i] * 4);
+        int yPos = oam[0] - 16;
+        int xPos = oam[1] - 8;
+        BYTE tileLocation = oam[2];
+        BYTE attributes = oam[3];
 
-        // translate the current x pos to window space if necessary
-        if (usingWindow)
-        {
-            if (pixel >= windowX)
-            {
-                xPos = pixel - windowX;
-            }
-        }
+        bool yFlip = TestBit(attributes, 6);
+        bool xFlip = TestBit(attributes, 5);
+        const BYTE* palette = m_Palettes[TestBit(attributes, 4) ? OBP1 : OBP0];
+
+        // 8x16 sprites ignore bit 0 of the tile number
+        if (ysize == 16)
+            tileLocation &= 0xFE;
+
+        int line = scanline - yPos;
+
+        // read the sprite in backwards in the y axis
+        if (yFlip)
+            line = ysize - 1 - line;
 
-        // which of the 32 horizontal tiles does this xPos fall within?
-        WORD tileCol = (xPos / 8);
-        SIGNED_WORD tileNum;
-
-        // get the tile identity number. Remember it can be signed
-        // or unsigned
-        WORD tileAddrss = backgroundMemory + tileRow + tileCol;
-        if (unsig)
-            tileNum = (BYTE)ReadMemory(tileAddrss);
-        else
-            tileNum = (SIGNED_BYTE)ReadMemory(tileAddrss);
-
-        // deduce where this tile identifier is in memory. Remember i
-        // shown this algorithm earlier
-        WORD tileLocation = tileData;
-
-        if (unsig)
-            tileLocation += (tileNum * 16);
-        else
-            tileLocation += ((tileNum + 128) * 16);
-
-        // find the correct vertical line we're on of the
-        // tile to get the tile data
-        //from in memory
-        BYTE line = yPos % 8;
-        line *= 2; // each vertical line takes up two bytes of memory
-        BYTE data1 = ReadMemory(tileLocation + line);
-        BYTE data2 = ReadMemory(tileLocation + line + 1);
-
-        // pixel 0 in the tile is it 7 of data 1 and data2.
-        // Pixel 1 is bit 6 etc..
-        int colourBit = xPos % 8;
-        colourBit -= 7;
-        colourBit *= -1;
-
-        // combine data 2 and data 1 to get the colour id for this pixel
-        // in the tile
-        int colourNum = BitGetVal(data2, colourBit);
-        colourNum <<= 1;
-        colourNum |= BitGetVal(data1, colourBit);
-
-        // now we have the colour id get the actual
-        // colour from palette 0xFF47
-        COLOUR col = GetColour(colourNum, 0xFF47);
-        int red = 0;
-        int green = 0;
-        int blue = 0;
-
-        // setup the RGB values
-        switch (col)
+        line *= 2; // same as for tiles
+        WORD dataAddress = (0x8000 + (tileLocation * 16)) + line;
+        const BYTE* planes = GetRenderMemory(dataAddress);
+
+        BYTE colourIds[8];
+        GetPixelKernels().DecodeTileRows(planes, colourIds, 1);
+
+        for (int xPix = 0; xPix < 8; xPix++)
         {
-        case WHITE: red = 255; green = 255; blue = 255; break;
-        case LIGHT_GRAY:red = 0xCC; green = 0xCC; blue = 0xCC; break;
-        case DARK_GRAY: red = 0x77; green = 0x77; blue = 0x77; break;
+            // read the sprite in backwards for the x axis
+            int colourNum = colourIds[xFlip ? 7 - xPix : xPix];
+
+            // colour id 0 is transparent for sprites
+            if (colourNum == 0)
+                continue;
+
+            int pixel = xPos + xPix;
+            if ((pixel < 0) || (pixel > 159))
+                continue;
+
+            m_LineShades[pixel] = palette[colourNum];
         }
+    }
+}
 
-        int finaly = ReadMemory(0xFF44);
+void Emulator::BuildSpriteLines(BYTE lcdControl)
+{
+    int ysize = TestBit(lcdControl, 2) ? 16 : 8;
+
+    for (SpriteLine& line : m_SpriteLines)
+        line.count = 0;
+
+    // the hardware picks the first 10 sprites in OAM order
+    // that cover a line, whatever their x position
+    for (BYTE sprite = 0; sprite < 40; sprite++)
+    {
+        int yPos = *GetRenderMemory(0xFE00 + sprite * 4) - 16;
+        int first = std::max(yPos, 0);
+        int last = std::min(yPos + ysize, 144);
 
-        // safety check to make sure what im about
-        // to set is int the 160x144 bounds
-        if ((finaly < 0) || (finaly > 143) || (pixel < 0) || (pixel > 159))
+        for (int scanline = first; scanline < last; scanline++)
         {
-            continue;
+            SpriteLine& line = m_SpriteLines[scanline];
+            if (line.count < 10)
+                line.sprites[line.count++] = sprite;
         }
+    }
+
+    // then the one with the smaller x wins, OAM order breaks ties.
+    // insertion sort keeps equal x in OAM order
+    for (SpriteLine& line : m_SpriteLines)
+    {
+        for (int i = 1; i < line.count; i++)
+        {
+            BYTE sprite = line.sprites[i];
+            BYTE xPos = *GetRenderMemory(0xFE00 + sprite * 4 + 1);
 
-        m_ScreenData[pixel][finaly][0] = red;
-        m_ScreenData[pixel][finaly][1] = green;
-        m_ScreenData[pixel][finaly][2] = blue;
+            int j = i - 1;
+            for (; j >= 0 && *GetRenderMemory(0xFE00 + line.sprites[j] * 4 + 1) > xPos; j--)
+                line.sprites[j + 1] = line.sprites[j];
+            line.sprites[j + 1] = sprite;
+        }
     }
+
+    m_SpritesDirty = false;
 }
 
-void Emulator::RenderSprites(BYTE lcdControl)
+void Emulator::UpdatePalette(WORD address)
 {
-    bool use8x16 = false;
-    if (TestBit(lcdControl, 2))
-        use8x16 = true;
+    BYTE palette = *GetRenderMemory(address);
+    BYTE* colours = m_Palettes[address - 0xFF47];
 
-    for (int sprite = 0; sprite < 40; sprite++)
+    // each colour id takes two bits of the palette, id 0 the lowest two
+    for (int colourNum = 0; colourNum < 4; colourNum++)
+        colours[colourNum] = (palette >> (colourNum * 2)) & 0x3;
+}
+
+void Emulator::OutputScanLine(int line)
+{
+    // nothing drawn yet, so every line counts as changed
+    if (!m_LastShades)
     {
-        // sprite occupies 4 bytes in the sprite attributes table
-        BYTE index = sprite * 4;
-        BYTE yPos = ReadMemory(0xFE00 + index) - 16;
-        BYTE xPos = ReadMemory(0xFE00 + index + 1) - 8;
-        BYTE tileLocation = ReadMemory(0xFE00 + index + 2);
-        BYTE attributes = ReadMemory(0xFE00 + index + 3);
+        m_LastShades = std::make_unique<BYTE[]>(144 * 160);
+        std::fill_n(m_LastShades.get(), 144 * 160, 0xFF);
+    }
 
-        bool yFlip = TestBit(attributes, 6);
-        bool xFlip = TestBit(attributes, 5);
+    // remember which lines look different from last time
+    BYTE* lastShades = &m_LastShades[line * 160];
+    if (std::memcmp(lastShades, m_LineShades, 160) != 0)
+    {
+        std::copy_n(m_LineShades, 160, lastShades);
+        m_DirtyRows.set(line);
+    }
 
-        int scanline = ReadMemory(0xFF44);
+    BYTE* row = GetFrameRow(line);
 
-        int ysize = 8;
-        if (use8x16)
-            ysize = 16;
+    switch (m_PixelFormat)
+    {
+    case PixelFormat::RGBA8888:
+        for (int pixel = 0; pixel < 160; pixel++)
+            std::memcpy(row + pixel * 4, &m_FormatColours[m_LineShades[pixel]], 4);
+        break;
 
-        // does this sprite intercept with the scanline?
-        if ((scanline >= yPos) && (scanline < (yPos + ysize)))
+    case PixelFormat::RGB565:
+        for (int pixel = 0; pixel < 160; pixel++)
         {
-            int line = scanline - yPos;
-
-            // read the sprite in backwards in the y axis
-            if (yFlip)
-            {
-                line -= ysize;
-                line *= -1;
-            }
-
-            line *= 2; // same as for tiles
-            WORD dataAddress = (0x8000 + (tileLocation * 16)) + line;
-            BYTE data1 = ReadMemory(dataAddress);
-            BYTE data2 = ReadMemory(dataAddress + 1);
-
-            // its easier to read in from right to left as pixel 0 is
-            // bit 7 in the colour data, pixel 1 is bit 6 etc...
-            for (int tilePixel = 7; tilePixel >= 0; tilePixel--)
-            {
-                int colourbit = tilePixel;
-                // read the sprite in backwards for the x axis
-                if (xFlip)
-                {
-                    colourbit -= 7;
-                    colourbit *= -1;
-                }
-
-                // the rest is the same as for tiles
-                int colourNum = BitGetVal(data2, colourbit);
-                colourNum <<= 1;
-                colourNum |= BitGetVal(data1, colourbit);
-
-                WORD colourAddress = TestBit(attributes, 4) ? 0xFF49 : 0xFF48;
-                COLOUR col = GetColour(colourNum, colourAddress);
-
-                // white is transparent for sprites.
-                if (col == WHITE)
-                    continue;
-
-                int red = 0;
-                int green = 0;
-                int blue = 0;
-
-                switch (col)
-                {
-                case WHITE: red = 255; green = 255; blue = 255; break;
-                case LIGHT_GRAY:red = 0xCC; green = 0xCC; blue = 0xCC; break;
-                case DARK_GRAY:red = 0x77; green = 0x77; blue = 0x77; break;
-                }
-
-                int xPix = 0 - tilePixel;
-                xPix += 7;
-
-                int pixel = xPos + xPix;
-
-                // sanity check
-                if ((scanline < 0) || (scanline > 143) || (pixel < 0) || (pixel > 159))
-                {
-                    continue;
-                }
-
-                m_ScreenData[pixel][scanline][0] = red;
-                m_ScreenData[pixel][scanline][1] = green;
-                m_ScreenData[pixel][scanline][2] = blue;
-            }
+            uint16_t colour = static_cast<uint16_t>(m_FormatColours[m_LineShades[pixel]]);
+            std::memcpy(row + pixel * 2, &colour, 2);
         }
+        break;
+
+    case PixelFormat::SHADE8:
+        std::copy_n(m_LineShades, 160, row);
+        break;
+
+    case PixelFormat::PACKED2BPP:
+        for (int i = 0; i < 40; i++)
+        {
+            const BYTE* shades = &m_LineShades[i * 4];
+            row[i] = (shades[0] << 6) | (shades[1] << 4) | (shades[2] << 2) | shades[3];
+        }
+        break;
+    }
+}
+
+BYTE* Emulator::GetFrameRow(int line)
+{
+    // the internal frame, once there's something to draw into it
+    if (!m_FrameBuffer)
+    {
+        m_OwnedFrame = std::make_unique<BYTE[]>(144 * GetRowBytes(PixelFormat::RGBA8888));
+        m_FrameBuffer = m_OwnedFrame.get();
+    }
+    return m_FrameBuffer + line * m_FramePitch;
+}
+
+void Emulator::VideoWrite(WORD address, BYTE data)
+{
+    // the CPU keeps using its own copy, the
+    // render thread picks the write up from the log
+    if (m_VideoLog)
+    {
+        GetWritableMemory(address) = data;
+        PushVideoEvent(VIDEO_WRITE, address, data);
+    }
+    else
+    {
+        ApplyVideoWrite(address, data);
     }
 }
 
-Emulator::COLOUR Emulator::GetColour(BYTE colourNum, WORD address) const
+void Emulator::ApplyVideoWrite(WORD address, BYTE data)
 {
-    COLOUR res = WHITE;
-    BYTE palette = ReadMemory(address);
-    int hi = 0;
-    int lo = 0;
+    BYTE& target = m_RenderShadow ? m_RenderShadow[address] : GetWritableMemory(address);
+    BYTE previous = target;
+    target = data;
 
-    // which bits of the colour palette does the colour id map to?
-    switch (colourNum)
+    // VRAM, tell the background layer cache something changed
+    if (address < 0xA000)
     {
-    case 0: hi = 1; lo = 0; break;
-    case 1: hi = 3; lo = 2; break;
-    case 2: hi = 5; lo = 4; break;
-    case 3: hi = 7; lo = 6; break;
+        if (address < 0x9800)
+            m_TileVersions[(address - 0x8000) / 16]++;
+        m_VramGeneration++;
     }
 
-    // use the palette to get the colour
-    int colour = 0;
-    colour = BitGetVal(palette, hi) << 1;
-    colour |= BitGetVal(palette, lo);
+    // sprite attributes, the per line sprite lists need rebuilding
+    else if (address < 0xFEA0)
+    {
+        m_SpritesDirty = true;
+    }
 
-    // convert the game colour to emulator colour
-    switch (colour)
+    else if (address == 0xFF40)
     {
-    case 0: res = WHITE; break;
-    case 1: res = LIGHT_GRAY; break;
-    case 2: res = DARK_GRAY; break;
-    case 3: res = BLACK; break;
+        // switching between 8x8 and 8x16 sprites changes which lines they cover
+        if (TestBit(previous ^ data, 2))
+            m_SpritesDirty = true;
+        // and the tile data area changes what the cached maps point at
+        if (TestBit(previous ^ data, 4))
+            m_VramGeneration++;
     }
 
-    return res;
-}
\ No newline at end of file
+    // keep the palette lookup tables in step with the registers
+    else if ((address >= 0xFF47) && (address <= 0xFF49))
+    {
+        UpdatePalette(address);
+    }
+}
+
+const BYTE* Emulator::GetRenderMemory(WORD address) const
+{
+    if (m_RenderShadow)
+        return &m_RenderShadow[address];
+    return &m_MemoryPages[address / RAM_PAGE_SIZE]->bytes[address % RAM_PAGE_SIZE];
+}
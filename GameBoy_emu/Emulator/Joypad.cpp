@@ -3,7 +3,7 @@
 
 BYTE Emulator::GetJoypadState() const
 {
-    BYTE res = m_Rom[0xFF00];
+    BYTE res = GetMemory(0xFF00);
     // flip all the bits
     res ^= 0xFF;
 
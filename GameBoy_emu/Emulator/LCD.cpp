@@ -8,10 +8,10 @@ void Emulator::SetLCDStatus()
     {
         // set the mode to 1 during lcd disabled and reset scanline
         m_ScanlineCounter = 456;
-        m_Rom[0xFF44] = 0;
+        GetWritableMemory(0xFF44) = 0;
         status &= 252;
         status = BitSet(status, 0);
-        WriteMemory(0xFF41, status);
+        GetWritableMemory(0xFF41) = status;
         return;
     }
 
@@ -74,7 +74,7 @@ void Emulator::SetLCDStatus()
     {
         status = BitReset(status, 2);
     }
-    WriteMemory(0xFF41, status);
+    GetWritableMemory(0xFF41) = status;
 }
 
 bool Emulator::IsLCDEnabled() const
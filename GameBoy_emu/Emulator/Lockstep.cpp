@@ -0,0 +1,717 @@
+#include "Emulator.h"
+#include "Misc/CpuFeatures.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define GB_LOCKSTEP_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define GB_TARGET(isa)
+#else
+#define GB_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+namespace
+{
+    using Rows = WORD[6][Emulator::LOCKSTEP_LANES];
+
+    enum LockstepRow
+    {
+        AF_ROW,
+        BC_ROW,
+        DE_ROW,
+        HL_ROW,
+        SP_ROW,
+        PC_ROW,
+    };
+
+    // the 8 bit registers by their number in an opcode, B C D E H L - A
+    int ByteRow(int reg)
+    {
+        return (reg == 7) ? AF_ROW : BC_ROW + reg / 2;
+    }
+
+    bool IsHighByte(int reg)
+    {
+        return (reg == 7) || ((reg & 1) == 0);
+    }
+
+    // BC, DE, HL, SP by bits 5-4, with AF in place of SP for PUSH and POP
+    int PairRow(BYTE opcode, bool stack = false)
+    {
+        int pair = (opcode >> 4) & 3;
+        return (stack && (pair == 3)) ? AF_ROW : BC_ROW + pair;
+    }
+
+    // NZ, Z, NC or C by bits 4-3, as the scalar CPU_JUMP/CALL/RETURN test them
+    bool IsConditionMet(WORD af, BYTE opcode)
+    {
+        bool set = af & ((opcode & 0x10) ? 0x10 : 0x80);
+        return set == ((opcode & 0x08) != 0);
+    }
+
+    // cycles of every instruction lanes can run together, 0 for the rest
+    constexpr std::array<BYTE, 256> MakeLockstepCycles()
+    {
+        std::array<BYTE, 256> cycles{};
+
+        // LD r, r' and the ALU on A, [HL] as either side takes 8
+        for (int opcode = 0x40; opcode < 0xC0; opcode++)
+            cycles[opcode] = (((opcode & 7) == 6) || ((opcode & 0xF8) == 0x70)) ? 8 : 4;
+        cycles[0x76] = 0;
+
+        for (int reg = 0; reg < 8; reg++)
+        {
+            if (reg == 6)
+                continue;
+            cycles[0x04 | (reg << 3)] = 4;
+            cycles[0x05 | (reg << 3)] = 4;
+            cycles[0x06 | (reg << 3)] = 8;
+        }
+        for (int pair = 0; pair < 4; pair++)
+        {
+            cycles[0x01 | (pair << 4)] = 12;
+            cycles[0x03 | (pair << 4)] = 8;
+            cycles[0x09 | (pair << 4)] = 8;
+            cycles[0x0B | (pair << 4)] = 8;
+            cycles[0xC1 | (pair << 4)] = 12;
+            cycles[0xC5 | (pair << 4)] = 16;
+        }
+        for (int condition = 0; condition < 4; condition++)
+        {
+            cycles[0x20 | (condition << 3)] = 8;
+            cycles[0xC0 | (condition << 3)] = 8;
+            cycles[0xC2 | (condition << 3)] = 12;
+            cycles[0xC4 | (condition << 3)] = 12;
+        }
+        for (int op = 0; op < 8; op++)
+            cycles[0xC6 | (op << 3)] = 8;
+
+        for (int opcode : { 0x00, 0x07, 0x0F, 0x17, 0x1F, 0x2F, 0x37, 0x3F, 0xE9 })
+            cycles[opcode] = 4;
+        for (int opcode : { 0x02, 0x0A, 0x12, 0x1A, 0x22, 0x2A, 0x32, 0x3A, 0x18, 0xE2, 0xF2, 0xF9, 0xC9 })
+            cycles[opcode] = 8;
+        for (int opcode : { 0x36, 0xE0, 0xF0, 0xC3, 0xCD })
+            cycles[opcode] = 12;
+        cycles[0xEA] = 16;
+        cycles[0xFA] = 16;
+        return cycles;
+    }
+
+    constexpr std::array<BYTE, 256> LOCKSTEP_CYCLES{ MakeLockstepCycles() };
+
+#ifdef GB_LOCKSTEP_X86
+    GB_TARGET("avx2")
+    __m256i Load(const WORD* row)
+    {
+        return _mm256_load_si256(reinterpret_cast<const __m256i*>(row));
+    }
+
+    // only the slots of `lanes` change
+    GB_TARGET("avx2")
+    void Store(WORD* row, __m256i value, __m256i lanes)
+    {
+        _mm256_store_si256(reinterpret_cast<__m256i*>(row), _mm256_blendv_epi8(Load(row), value, lanes));
+    }
+
+    GB_TARGET("avx2")
+    __m256i Splat(int value)
+    {
+        return _mm256_set1_epi16(static_cast<short>(value));
+    }
+
+    // `bit` where the comparison held
+    GB_TARGET("avx2")
+    __m256i FlagIf(__m256i condition, int bit)
+    {
+        return _mm256_and_si256(condition, Splat(bit));
+    }
+
+    GB_TARGET("avx2")
+    __m256i LaneMask(uint32_t group)
+    {
+        const __m256i bits = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128,
+            256, 512, 1024, 2048, 4096, 8192, 16384, -32768);
+        return _mm256_cmpeq_epi16(_mm256_and_si256(Splat(group), bits), bits);
+    }
+
+    GB_TARGET("avx2")
+    __m256i GetByte(const Rows& regs, int reg)
+    {
+        __m256i pair = Load(regs[ByteRow(reg)]);
+        return IsHighByte(reg) ? _mm256_srli_epi16(pair, 8) : _mm256_and_si256(pair, Splat(0xFF));
+    }
+
+    GB_TARGET("avx2")
+    void SetByte(Rows& regs, int reg, __m256i value, __m256i lanes)
+    {
+        WORD* row = regs[ByteRow(reg)];
+        __m256i pair = Load(row);
+        if (IsHighByte(reg))
+            pair = _mm256_or_si256(_mm256_and_si256(pair, Splat(0x00FF)), _mm256_slli_epi16(value, 8));
+        else
+            pair = _mm256_or_si256(_mm256_and_si256(pair, Splat(0xFF00)), value);
+        Store(row, pair, lanes);
+    }
+
+    GB_TARGET("avx2")
+    __m256i GetFlags(const Rows& regs)
+    {
+        return _mm256_and_si256(Load(regs[AF_ROW]), Splat(0xFF));
+    }
+
+    GB_TARGET("avx2")
+    void SetFlags(Rows& regs, __m256i flags, __m256i lanes)
+    {
+        Store(regs[AF_ROW], _mm256_or_si256(_mm256_and_si256(Load(regs[AF_ROW]), Splat(0xFF00)), flags), lanes);
+    }
+
+    // lanes where a conditional jump, call or return is taken
+    GB_TARGET("avx2")
+    __m256i IsConditionMet(const Rows& regs, BYTE opcode)
+    {
+        __m256i clear = _mm256_cmpeq_epi16(_mm256_and_si256(GetFlags(regs), Splat((opcode & 0x10) ? 0x10 : 0x80)),
+            _mm256_setzero_si256());
+        return (opcode & 0x08) ? _mm256_xor_si256(clear, _mm256_set1_epi32(-1)) : clear;
+    }
+
+    // ADD ADC SUB SBC AND XOR OR CP by `op`, flags exactly as CPU_8BIT_ADD() and the rest set them
+    GB_TARGET("avx2")
+    void AluA(Rows& regs, int op, __m256i operand, __m256i lanes)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i low = Splat(0xFF);
+        const __m256i nibble = Splat(0x0F);
+        __m256i a = GetByte(regs, 7);
+        __m256i carry = _mm256_and_si256(_mm256_srli_epi16(GetFlags(regs), 4), Splat(1));
+        __m256i result{};
+        __m256i flags{};
+
+        switch (op)
+        {
+        case 0:
+        case 1:
+        {
+            // the carry goes onto the operand as a byte, wrapping at 0xFF
+            __m256i adding = (op == 1) ? _mm256_and_si256(_mm256_add_epi16(operand, carry), low) : operand;
+            __m256i sum = _mm256_add_epi16(a, adding);
+            __m256i halves = _mm256_add_epi16(_mm256_and_si256(a, nibble), _mm256_and_si256(adding, nibble));
+            result = _mm256_and_si256(sum, low);
+            flags = _mm256_or_si256(FlagIf(_mm256_cmpeq_epi16(result, zero), 0x80),
+                _mm256_or_si256(FlagIf(_mm256_cmpgt_epi16(halves, nibble), 0x20), FlagIf(_mm256_cmpgt_epi16(sum, low), 0x10)));
+            break;
+        }
+        case 2:
+        case 3:
+        case 7:
+        {
+            __m256i subtracting = (op == 3) ? _mm256_and_si256(_mm256_add_epi16(operand, carry), low) : operand;
+            __m256i difference = _mm256_and_si256(_mm256_sub_epi16(a, subtracting), low);
+            __m256i halfBorrow = _mm256_cmpgt_epi16(_mm256_and_si256(subtracting, nibble), _mm256_and_si256(a, nibble));
+            flags = _mm256_or_si256(_mm256_or_si256(Splat(0x40), FlagIf(_mm256_cmpeq_epi16(difference, zero), 0x80)),
+                _mm256_or_si256(FlagIf(_mm256_cmpgt_epi16(subtracting, a), 0x10), FlagIf(halfBorrow, 0x20)));
+            result = (op == 7) ? a : difference;
+            break;
+        }
+        case 4:
+            result = _mm256_and_si256(a, operand);
+            flags = _mm256_or_si256(Splat(0x20), FlagIf(_mm256_cmpeq_epi16(result, zero), 0x80));
+            break;
+        case 5:
+            result = _mm256_xor_si256(a, operand);
+            flags = FlagIf(_mm256_cmpeq_epi16(result, zero), 0x80);
+            break;
+        case 6:
+            result = _mm256_or_si256(a, operand);
+            flags = FlagIf(_mm256_cmpeq_epi16(result, zero), 0x80);
+            break;
+        }
+
+        Store(regs[AF_ROW], _mm256_or_si256(_mm256_slli_epi16(result, 8), flags), lanes);
+    }
+
+    // C and the low nibble of F stay as they are
+    GB_TARGET("avx2")
+    void IncDec(Rows& regs, int reg, bool decrement, __m256i lanes)
+    {
+        const __m256i nibble = Splat(0x0F);
+        __m256i before = GetByte(regs, reg);
+        __m256i result = _mm256_and_si256(decrement ? _mm256_sub_epi16(before, Splat(1)) : _mm256_add_epi16(before, Splat(1)), Splat(0xFF));
+        __m256i halfCarry = _mm256_cmpeq_epi16(_mm256_and_si256(before, nibble), decrement ? _mm256_setzero_si256() : nibble);
+        __m256i flags = _mm256_or_si256(_mm256_and_si256(GetFlags(regs), Splat(0x1F)),
+            _mm256_or_si256(FlagIf(_mm256_cmpeq_epi16(result, _mm256_setzero_si256()), 0x80), FlagIf(halfCarry, 0x20)));
+        if (decrement)
+            flags = _mm256_or_si256(flags, Splat(0x40));
+
+        SetByte(regs, reg, result, lanes);
+        SetFlags(regs, flags, lanes);
+    }
+
+    // Z and the low nibble of F stay as they are
+    GB_TARGET("avx2")
+    void AddHL(Rows& regs, int row, __m256i lanes)
+    {
+        __m256i before = Load(regs[HL_ROW]);
+        __m256i adding = Load(regs[row]);
+        __m256i sum = _mm256_add_epi16(before, adding);
+        __m256i carry = _mm256_xor_si256(_mm256_cmpeq_epi16(_mm256_max_epu16(sum, before), sum), _mm256_set1_epi32(-1));
+        __m256i halves = _mm256_add_epi16(_mm256_and_si256(before, Splat(0xFFF)), _mm256_and_si256(adding, Splat(0xFFF)));
+        __m256i flags = _mm256_or_si256(_mm256_and_si256(GetFlags(regs), Splat(0x8F)),
+            _mm256_or_si256(FlagIf(carry, 0x10), FlagIf(_mm256_cmpgt_epi16(halves, Splat(0xFFF)), 0x20)));
+
+        Store(regs[HL_ROW], sum, lanes);
+        SetFlags(regs, flags, lanes);
+    }
+
+    // RLCA RRCA RLA RRA by `op`, Z always clear
+    GB_TARGET("avx2")
+    void RotateA(Rows& regs, int op, __m256i lanes)
+    {
+        __m256i a = GetByte(regs, 7);
+        __m256i carry = _mm256_and_si256(_mm256_srli_epi16(GetFlags(regs), 4), Splat(1));
+        __m256i top = _mm256_srli_epi16(a, 7);
+        __m256i bottom = _mm256_and_si256(a, Splat(1));
+        __m256i result{};
+        __m256i out{};
+
+        switch (op)
+        {
+        case 0: result = _mm256_or_si256(_mm256_slli_epi16(a, 1), top); out = top; break;
+        case 1: result = _mm256_or_si256(_mm256_srli_epi16(a, 1), _mm256_slli_epi16(bottom, 7)); out = bottom; break;
+        case 2: result = _mm256_or_si256(_mm256_slli_epi16(a, 1), carry); out = top; break;
+        case 3: result = _mm256_or_si256(_mm256_srli_epi16(a, 1), _mm256_slli_epi16(carry, 7)); out = bottom; break;
+        }
+
+        result = _mm256_and_si256(result, Splat(0xFF));
+        Store(regs[AF_ROW], _mm256_or_si256(_mm256_slli_epi16(result, 8), _mm256_slli_epi16(out, 4)), lanes);
+    }
+
+    // PC to `taken` where the lanes jump, `next` where they don't
+    GB_TARGET("avx2")
+    void Jump(Rows& regs, __m256i condition, __m256i taken, __m256i next, __m256i lanes)
+    {
+        Store(regs[PC_ROW], _mm256_blendv_epi8(next, taken, condition), lanes);
+    }
+
+    // Everything an instruction does to the registers of the lanes in `group`,
+    // anything it read from memory in `loaded`
+    GB_TARGET("avx2")
+    void ExecuteLockstepGroup(Rows& regs, uint32_t group, BYTE opcode, WORD nn, const WORD* loaded)
+    {
+        const __m256i lanes = LaneMask(group);
+        const __m256i memory = Load(loaded);
+        const __m256i pc = Load(regs[PC_ROW]);
+        const __m256i sp = Load(regs[SP_ROW]);
+        const __m256i two = Splat(2);
+        const int relative = 2 + static_cast<SIGNED_BYTE>(nn & 0xFF);
+        int length = 1;
+
+        switch (opcode)
+        {
+        case 0x00:
+            break;
+
+        case 0x01: case 0x11: case 0x21: case 0x31:
+            Store(regs[PairRow(opcode)], Splat(nn), lanes);
+            length = 3;
+            break;
+
+        case 0x03: case 0x13: case 0x23: case 0x33:
+            Store(regs[PairRow(opcode)], _mm256_add_epi16(Load(regs[PairRow(opcode)]), Splat(1)), lanes);
+            break;
+
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+            Store(regs[PairRow(opcode)], _mm256_sub_epi16(Load(regs[PairRow(opcode)]), Splat(1)), lanes);
+            break;
+
+        case 0x09: case 0x19: case 0x29: case 0x39:
+            AddHL(regs, PairRow(opcode), lanes);
+            break;
+
+        case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C:
+            IncDec(regs, opcode >> 3, false, lanes);
+            break;
+
+        case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D:
+            IncDec(regs, opcode >> 3, true, lanes);
+            break;
+
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E:
+            SetByte(regs, opcode >> 3, Splat(nn & 0xFF), lanes);
+            length = 2;
+            break;
+
+        case 0x36:
+        case 0xE0:
+            length = 2;
+            break;
+
+        case 0x07: case 0x0F: case 0x17: case 0x1F:
+            RotateA(regs, opcode >> 3, lanes);
+            break;
+
+        // CPL, SCF, CCF
+        case 0x2F:
+            Store(regs[AF_ROW], _mm256_xor_si256(_mm256_or_si256(Load(regs[AF_ROW]), Splat(0x60)), Splat(0xFF00)), lanes);
+            break;
+        case 0x37:
+            SetFlags(regs, _mm256_or_si256(_mm256_and_si256(GetFlags(regs), Splat(0x9F)), Splat(0x10)), lanes);
+            break;
+        case 0x3F:
+            SetFlags(regs, _mm256_xor_si256(_mm256_and_si256(GetFlags(regs), Splat(0x9F)), Splat(0x10)), lanes);
+            break;
+
+        case 0x0A: case 0x1A: case 0xF2:
+            SetByte(regs, 7, memory, lanes);
+            break;
+        case 0x2A:
+            SetByte(regs, 7, memory, lanes);
+            Store(regs[HL_ROW], _mm256_add_epi16(Load(regs[HL_ROW]), Splat(1)), lanes);
+            break;
+        case 0x3A:
+            SetByte(regs, 7, memory, lanes);
+            Store(regs[HL_ROW], _mm256_sub_epi16(Load(regs[HL_ROW]), Splat(1)), lanes);
+            break;
+        case 0xF0:
+            SetByte(regs, 7, memory, lanes);
+            length = 2;
+            break;
+        case 0xFA:
+            SetByte(regs, 7, memory, lanes);
+            length = 3;
+            break;
+
+        case 0x02: case 0x12: case 0xE2:
+            break;
+        case 0x22:
+            Store(regs[HL_ROW], _mm256_add_epi16(Load(regs[HL_ROW]), Splat(1)), lanes);
+            break;
+        case 0x32:
+            Store(regs[HL_ROW], _mm256_sub_epi16(Load(regs[HL_ROW]), Splat(1)), lanes);
+            break;
+        case 0xEA:
+            length = 3;
+            break;
+
+        case 0xF9:
+            Store(regs[SP_ROW], Load(regs[HL_ROW]), lanes);
+            break;
+
+        case 0xC5: case 0xD5: case 0xE5: case 0xF5:
+            Store(regs[SP_ROW], _mm256_sub_epi16(sp, two), lanes);
+            break;
+        case 0xC1: case 0xD1: case 0xE1: case 0xF1:
+            Store(regs[PairRow(opcode, true)], memory, lanes);
+            Store(regs[SP_ROW], _mm256_add_epi16(sp, two), lanes);
+            break;
+
+        case 0x18:
+            Store(regs[PC_ROW], _mm256_add_epi16(pc, Splat(relative)), lanes);
+            return;
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            Jump(regs, IsConditionMet(regs, opcode), _mm256_add_epi16(pc, Splat(relative)), _mm256_add_epi16(pc, two), lanes);
+            return;
+
+        case 0xC3:
+            Store(regs[PC_ROW], Splat(nn), lanes);
+            return;
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+            Jump(regs, IsConditionMet(regs, opcode), Splat(nn), _mm256_add_epi16(pc, Splat(3)), lanes);
+            return;
+        case 0xE9:
+            Store(regs[PC_ROW], Load(regs[HL_ROW]), lanes);
+            return;
+
+        case 0xCD:
+            Store(regs[SP_ROW], _mm256_sub_epi16(sp, two), lanes);
+            Store(regs[PC_ROW], Splat(nn), lanes);
+            return;
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+        {
+            __m256i taken = IsConditionMet(regs, opcode);
+            Store(regs[SP_ROW], _mm256_sub_epi16(sp, two), _mm256_and_si256(lanes, taken));
+            Jump(regs, taken, Splat(nn), _mm256_add_epi16(pc, Splat(3)), lanes);
+            return;
+        }
+
+        case 0xC9:
+            Store(regs[SP_ROW], _mm256_add_epi16(sp, two), lanes);
+            Store(regs[PC_ROW], memory, lanes);
+            return;
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+        {
+            __m256i taken = IsConditionMet(regs, opcode);
+            Store(regs[SP_ROW], _mm256_add_epi16(sp, two), _mm256_and_si256(lanes, taken));
+            Jump(regs, taken, memory, _mm256_add_epi16(pc, Splat(1)), lanes);
+            return;
+        }
+
+        default:
+        {
+            int source = opcode & 7;
+            int target = (opcode >> 3) & 7;
+            __m256i operand = (source == 6) ? memory : GetByte(regs, source);
+
+            // LD r, r' and LD r, [HL], the memory side of LD [HL], r is already done
+            if (opcode < 0x80)
+            {
+                if (target != 6)
+                    SetByte(regs, target, operand, lanes);
+            }
+            else if (opcode < 0xC0)
+            {
+                AluA(regs, target, operand, lanes);
+            }
+            // ALU on A, n8
+            else
+            {
+                AluA(regs, target, Splat(nn & 0xFF), lanes);
+                length = 2;
+            }
+            break;
+        }
+        }
+
+        Store(regs[PC_ROW], _mm256_add_epi16(pc, Splat(length)), lanes);
+    }
+#endif // GB_LOCKSTEP_X86
+}
+
+Emulator::LockstepCounts Emulator::UpdateLockstep(Emulator* const* lanes, int count)
+{
+    LockstepCounts counts{};
+
+    // more lanes than fit in a register, a batch at a time
+    if (count > LOCKSTEP_LANES)
+    {
+        for (int first = 0; first < count; first += LOCKSTEP_LANES)
+        {
+            LockstepCounts batch = UpdateLockstep(lanes + first, std::min(LOCKSTEP_LANES, count - first));
+            counts.steps += batch.steps;
+            counts.together += batch.together;
+        }
+        return counts;
+    }
+
+    // with one lane, or no AVX2, there's nothing to run together
+    if ((count < 2) || !CpuHasAVX2())
+    {
+        for (int lane = 0; lane < count; lane++)
+            lanes[lane]->Update();
+        return counts;
+    }
+
+    alignas(32) LockstepRegisters regs{};
+    int cyclesThisUpdate[LOCKSTEP_LANES]{};
+    int cycles[LOCKSTEP_LANES]{};
+    // PC and the 3 bytes there, lanes with the same run the instruction together
+    uint64_t code[LOCKSTEP_LANES]{};
+
+    uint32_t running = (1u << count) - 1;
+    for (int lane = 0; lane < count; lane++)
+    {
+        lanes[lane]->m_FrameDone = false;
+        lanes[lane]->StoreLockstepLane(regs, lane);
+    }
+
+    while (running != 0)
+    {
+        // as far as Update() goes, lane by lane, up to the next instruction
+        uint32_t ready = 0;
+        for (uint32_t left = running; left != 0; left &= left - 1)
+        {
+            int lane = std::countr_zero(left);
+            Emulator& emu = *lanes[lane];
+            if (emu.m_FrameDone || (!emu.IsLCDEnabled() && (cyclesThisUpdate[lane] >= FRAME_CYCLES)))
+            {
+                running &= ~(1u << lane);
+                continue;
+            }
+            emu.ApplyDueInput();
+
+            // only ROM is the same on every lane, and EI/DI taking effect is left to ExecuteNextOpcode()
+            WORD pc = regs[PC_ROW][lane];
+            if (emu.m_Halted || emu.m_PendingInteruptDisabled || emu.m_PendingInteruptEnabled || (pc > 0x7FFD))
+                continue;
+            BYTE opcode = emu.ReadMemory(pc);
+            if (LOCKSTEP_CYCLES[opcode] == 0)
+                continue;
+            code[lane] = (uint64_t{ pc } << 24) | (emu.ReadMemory(pc + 2) << 16) | (emu.ReadMemory(pc + 1) << 8) | opcode;
+            ready |= 1u << lane;
+        }
+
+        uint32_t alone = running & ~ready;
+        while (ready != 0)
+        {
+            int leader = std::countr_zero(ready);
+            uint32_t group = 0;
+            for (uint32_t left = ready; left != 0; left &= left - 1)
+            {
+                int lane = std::countr_zero(left);
+                if (code[lane] == code[leader])
+                    group |= 1u << lane;
+            }
+            ready &= ~group;
+
+            int groupCycles = 0;
+            BYTE opcode = code[leader] & 0xFF;
+            WORD nn = (code[leader] >> 8) & 0xFFFF;
+            if ((std::popcount(group) < 2) || !StepLockstepGroup(lanes, group, regs, opcode, nn, groupCycles))
+            {
+                alone |= group;
+                continue;
+            }
+            for (uint32_t left = group; left != 0; left &= left - 1)
+                cycles[std::countr_zero(left)] = groupCycles;
+            counts.together += std::popcount(group);
+        }
+
+        for (uint32_t left = alone; left != 0; left &= left - 1)
+        {
+            int lane = std::countr_zero(left);
+            Emulator& emu = *lanes[lane];
+
+            // all ExecuteNextOpcode() would do
+            if (emu.m_Halted && !emu.m_PendingInteruptDisabled && !emu.m_PendingInteruptEnabled)
+            {
+                cycles[lane] = 4;
+                continue;
+            }
+            emu.LoadLockstepLane(regs, lane);
+            cycles[lane] = emu.ExecuteNextOpcode();
+            emu.StoreLockstepLane(regs, lane);
+        }
+
+        // the rest of Update()'s step, only an interrupt needs the registers
+        for (uint32_t left = running; left != 0; left &= left - 1)
+        {
+            int lane = std::countr_zero(left);
+            Emulator& emu = *lanes[lane];
+            cyclesThisUpdate[lane] += cycles[lane];
+            emu.m_TotalCycles += cycles[lane];
+            emu.UpdateTimers(cycles[lane]);
+            emu.UpdateGraphics(cycles[lane]);
+            if (emu.m_InteruptMaster)
+            {
+                emu.LoadLockstepLane(regs, lane);
+                emu.DoInterupts();
+                emu.StoreLockstepLane(regs, lane);
+            }
+        }
+        counts.steps += std::popcount(running);
+    }
+
+    for (int lane = 0; lane < count; lane++)
+    {
+        lanes[lane]->LoadLockstepLane(regs, lane);
+        lanes[lane]->FinishUpdate();
+    }
+    return counts;
+}
+
+bool Emulator::StepLockstepGroup(Emulator* const* lanes, uint32_t group, LockstepRegisters& regs,
+    BYTE opcode, WORD nn, int& cycles)
+{
+#ifdef GB_LOCKSTEP_X86
+    cycles = LOCKSTEP_CYCLES[opcode];
+    if (cycles == 0)
+        return false;
+
+    // memory lane by lane, with the registers as they were before the instruction
+    alignas(32) WORD loaded[LOCKSTEP_LANES]{};
+    BYTE n = nn & 0xFF;
+    for (uint32_t left = group; left != 0; left &= left - 1)
+    {
+        int lane = std::countr_zero(left);
+        Emulator& emu = *lanes[lane];
+        BYTE a = regs[AF_ROW][lane] >> 8;
+        WORD hl = regs[HL_ROW][lane];
+        WORD sp = regs[SP_ROW][lane];
+
+        auto push = [&emu, sp](WORD word) {
+            emu.WriteMemory(sp - 1, word >> 8);
+            emu.WriteMemory(sp - 2, word & 0xFF);
+        };
+        auto pop = [&emu, sp] {
+            return static_cast<WORD>((emu.ReadMemory(sp + 1) << 8) | emu.ReadMemory(sp));
+        };
+
+        switch (opcode)
+        {
+        case 0x0A: loaded[lane] = emu.ReadMemory(regs[BC_ROW][lane]); break;
+        case 0x1A: loaded[lane] = emu.ReadMemory(regs[DE_ROW][lane]); break;
+        case 0xF0: loaded[lane] = emu.ReadMemory(0xFF00 | n); break;
+        case 0xF2: loaded[lane] = emu.ReadMemory(0xFF00 | (regs[BC_ROW][lane] & 0xFF)); break;
+        case 0xFA: loaded[lane] = emu.ReadMemory(nn); break;
+
+        case 0x02: emu.WriteMemory(regs[BC_ROW][lane], a); break;
+        case 0x12: emu.WriteMemory(regs[DE_ROW][lane], a); break;
+        case 0x22: case 0x32: case 0x77: emu.WriteMemory(hl, a); break;
+        case 0x36: emu.WriteMemory(hl, n); break;
+        case 0xE0: emu.WriteMemory(0xFF00 | n, a); break;
+        case 0xE2: emu.WriteMemory(0xFF00 | (regs[BC_ROW][lane] & 0xFF), a); break;
+        case 0xEA: emu.WriteMemory(nn, a); break;
+
+        case 0x70: case 0x71: case 0x72: case 0x73:
+            emu.WriteMemory(hl, regs[ByteRow(opcode & 7)][lane] >> (IsHighByte(opcode & 7) ? 8 : 0));
+            break;
+        case 0x74: emu.WriteMemory(hl, hl >> 8); break;
+        case 0x75: emu.WriteMemory(hl, hl & 0xFF); break;
+
+        case 0xC5: case 0xD5: case 0xE5: case 0xF5:
+            push(regs[PairRow(opcode, true)][lane]);
+            break;
+        case 0xCD:
+            push(regs[PC_ROW][lane] + 3);
+            break;
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+            if (IsConditionMet(regs[AF_ROW][lane], opcode))
+                push(regs[PC_ROW][lane] + 3);
+            break;
+
+        case 0xC1: case 0xD1: case 0xE1: case 0xF1: case 0xC9:
+            loaded[lane] = pop();
+            break;
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+            if (IsConditionMet(regs[AF_ROW][lane], opcode))
+                loaded[lane] = pop();
+            break;
+
+        default:
+            // LD A, [HL+/-], LD r, [HL] and the ALU on [HL]
+            if ((opcode == 0x2A) || (opcode == 0x3A) || ((opcode >= 0x40) && (opcode < 0xC0) && ((opcode & 7) == 6)))
+                loaded[lane] = emu.ReadMemory(hl);
+            break;
+        }
+    }
+
+    ExecuteLockstepGroup(regs, group, opcode, nn, loaded);
+    return true;
+#else
+    return false;
+#endif // GB_LOCKSTEP_X86
+}
+
+void Emulator::LoadLockstepLane(const LockstepRegisters& regs, int lane)
+{
+    AF = regs[AF_ROW][lane];
+    BC = regs[BC_ROW][lane];
+    DE = regs[DE_ROW][lane];
+    HL = regs[HL_ROW][lane];
+    SP = regs[SP_ROW][lane];
+    PC = regs[PC_ROW][lane];
+}
+
+void Emulator::StoreLockstepLane(LockstepRegisters& regs, int lane) const
+{
+    regs[AF_ROW][lane] = AF;
+    regs[BC_ROW][lane] = BC;
+    regs[DE_ROW][lane] = DE;
+    regs[HL_ROW][lane] = HL;
+    regs[SP_ROW][lane] = SP;
+    regs[PC_ROW][lane] = PC;
+}
@@ -9,22 +9,34 @@ void Emulator::WriteMemory(WORD address, BYTE data)
         HandleBanking(address, data);
     }
 
+    // VRAM, the renderer caches what it draws from here
+    else if ((address >= 0x8000) && (address < 0xA000))
+    {
+        VideoWrite(address, data);
+    }
+
     else if ((address >= 0xA000) && (address < 0xC000))
     {
         if (m_EnableRAM)
         {
-            WORD newAddress = address - 0xA000;
-            m_RAMBanks[newAddress + (m_CurrentRAMBank * 0x2000)] = data;
+            int ramAddress = (address - 0xA000) + (m_CurrentRAMBank * 0x2000);
+            GetWritableRamPage(ramAddress / RAM_PAGE_SIZE).bytes[ramAddress % RAM_PAGE_SIZE] = data;
         }
     }
 
     // writing to ECHO ram also writes in RAM
     else if ((address >= 0xE000) && (address < 0xFE00))
     {
-        m_Rom[address] = data;
+        GetWritableMemory(address) = data;
         WriteMemory(address - 0x2000, data);
     }
 
+    // sprite attributes
+    else if ((address >= 0xFE00) && (address < 0xFEA0))
+    {
+        VideoWrite(address, data);
+    }
+
     // this area is restricted
     else if ((address >= 0xFEA0) && (address < 0xFEFF))
     {
@@ -33,12 +45,12 @@ void Emulator::WriteMemory(WORD address, BYTE data)
 
     //trap the divider register
     else if (0xFF04 == address)
-        m_Rom[0xFF04] = 0;
+        GetWritableMemory(0xFF04) = 0;
 
     else if (TMC == address)
     {
         BYTE currentfreq = GetClockFreq();
-        m_Rom[TMC] = data;
+        GetWritableMemory(TMC) = data;
         BYTE newfreq = GetClockFreq();
 
         if (currentfreq != newfreq)
@@ -47,10 +59,23 @@ void Emulator::WriteMemory(WORD address, BYTE data)
         }
     }
 
+    // LCD control, scroll and window position registers
+    else if ((address == 0xFF40) || (address == 0xFF42) || (address == 0xFF43)
+        || (address == 0xFF4A) || (address == 0xFF4B))
+    {
+        VideoWrite(address, data);
+    }
+
+    // the mode and coincidence bits of the LCD status are read only
+    else if (address == 0xFF41)
+    {
+        GetWritableMemory(address) = (data & 0xF8) | (GetMemory(address) & 0x07);
+    }
+
     // reset the current scanline if the game tries to write to it
     else if (address == 0xFF44)
     {
-        m_Rom[address] = 0;
+        GetWritableMemory(address) = 0;
     }
 
     else if (address == 0xFF46)
@@ -58,10 +83,16 @@ void Emulator::WriteMemory(WORD address, BYTE data)
         DoDMATransfer(data);
     }
 
+    // palettes
+    else if ((address >= 0xFF47) && (address <= 0xFF49))
+    {
+        VideoWrite(address, data);
+    }
+
     // no control needed over this area so write to memory
     else
     {
-        m_Rom[address] = data;
+        GetWritableMemory(address) = data;
     }
 }
 
@@ -77,15 +108,15 @@ BYTE Emulator::ReadMemory(WORD address) const
     // are we reading from ram memory bank?
     else if ((address >= 0xA000) && (address <= 0xBFFF))
     {
-        WORD newAddress = address - 0xA000;
-        return m_RAMBanks[newAddress + (m_CurrentRAMBank * 0x2000)];
+        int ramAddress = (address - 0xA000) + (m_CurrentRAMBank * 0x2000);
+        return m_RAMPages[ramAddress / RAM_PAGE_SIZE]->bytes[ramAddress % RAM_PAGE_SIZE];
     }
 
     else if (0xFF00 == address)
         return GetJoypadState();
 
     // else return memory
-    return m_Rom[address];
+    return GetMemory(address);
 }
 
 void Emulator::HandleBanking(WORD address, BYTE data) 
@@ -185,4 +216,26 @@ void Emulator::DoChangeROMRAMMode(BYTE data)
     m_RomBanking = (newData == 0) ? true : false;
     if (m_RomBanking)
         m_CurrentRAMBank = 0;
+}
+
+Emulator::RamPage& Emulator::GetWritableRamPage(int page)
+{
+    // whoever else still points at the old page keeps it as it was
+    if (!TestBit(m_OwnedRAMPages, page))
+    {
+        m_RAMPages[page] = std::make_shared<RamPage>(*m_RAMPages[page]);
+        m_OwnedRAMPages = BitSet(m_OwnedRAMPages, page);
+    }
+    return *m_RAMPages[page];
+}
+
+Emulator::RamPage& Emulator::GetWritableMemoryPage(int page)
+{
+    // a 64 bit mask, TestBit() shifts an int
+    if (((m_OwnedMemoryPages >> page) & 1) == 0)
+    {
+        m_MemoryPages[page] = std::make_shared<RamPage>(*m_MemoryPages[page]);
+        m_OwnedMemoryPages |= uint64_t(1) << page;
+    }
+    return *m_MemoryPages[page];
 }
\ No newline at end of file
@@ -0,0 +1,198 @@
+#include "BatchRunner.h"
+#include "../Emulator.h"
+
+#include <algorithm>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace
+{
+	uint64_t MakeRange(uint32_t next, uint32_t end)
+	{
+		return (uint64_t(end) << 32) | next;
+	}
+
+	void PinToCore(std::thread& thread, int core)
+	{
+#if defined(_WIN32)
+		SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << (core % (sizeof(DWORD_PTR) * 8)));
+#elif defined(__linux__)
+		cpu_set_t cores;
+		CPU_ZERO(&cores);
+		CPU_SET(core % CPU_SETSIZE, &cores);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(cores), &cores);
+#else
+		// nothing to pin with, the scheduler decides
+		(void)thread;
+		(void)core;
+#endif
+	}
+}
+
+BatchRunner::BatchRunner(std::string_view romPath, int instances, int threads, bool pinThreads)
+{
+	// loaded once, the rest share the cartridge
+	auto first = std::make_unique<Emulator>();
+	first->LoadGame(romPath);
+	m_Instances.reserve(std::max(instances, 1));
+	for (int i = 1; i < instances; i++)
+		m_Instances.push_back(first->Fork());
+	m_Instances.insert(m_Instances.begin(), std::move(first));
+
+	if (threads <= 0)
+		threads = std::max(1, int(std::thread::hardware_concurrency()));
+	threads = std::min(threads, GetInstanceCount());
+
+	m_Shares = std::make_unique<Share[]>(threads);
+	for (int worker = 1; worker < threads; worker++)
+	{
+		m_Threads.emplace_back(&BatchRunner::WorkerLoop, this, worker);
+		if (pinThreads)
+			PinToCore(m_Threads.back(), worker);
+	}
+}
+
+BatchRunner::~BatchRunner()
+{
+	m_Stop = true;
+	m_Generation.fetch_add(1, std::memory_order_release);
+	m_Generation.notify_all();
+	for (std::thread& thread : m_Threads)
+		thread.join();
+}
+
+void BatchRunner::Step(const uint8_t* buttons, int frames)
+{
+	m_Buttons = buttons;
+	m_Frames = frames;
+
+	// even shares to start with, stealing evens out the rest
+	uint32_t instances = static_cast<uint32_t>(m_Instances.size());
+	int threads = GetThreadCount();
+	for (int worker = 0; worker < threads; worker++)
+	{
+		uint32_t next = uint32_t(uint64_t(instances) * worker / threads);
+		uint32_t end = uint32_t(uint64_t(instances) * (worker + 1) / threads);
+		m_Shares[worker].range.store(MakeRange(next, end), std::memory_order_relaxed);
+	}
+
+	m_Running.store(threads, std::memory_order_relaxed);
+	m_Generation.fetch_add(1, std::memory_order_release);
+	m_Generation.notify_all();
+
+	RunShare(0);
+	m_Running.fetch_sub(1, std::memory_order_acq_rel);
+
+	// every instance was taken once all threads are out of RunShare(),
+	// and the ones that took them are done with them
+	for (int running; (running = m_Running.load(std::memory_order_acquire)) != 0;)
+		m_Running.wait(running, std::memory_order_acquire);
+}
+
+int BatchRunner::GetInstanceCount() const
+{
+	return static_cast<int>(m_Instances.size());
+}
+
+int BatchRunner::GetThreadCount() const
+{
+	return static_cast<int>(m_Threads.size()) + 1;
+}
+
+Emulator& BatchRunner::GetInstance(int index)
+{
+	return *m_Instances[index];
+}
+
+void BatchRunner::WorkerLoop(int worker)
+{
+	uint32_t seen = 0;
+	while (true)
+	{
+		m_Generation.wait(seen, std::memory_order_acquire);
+		seen = m_Generation.load(std::memory_order_acquire);
+		if (m_Stop)
+			return;
+
+		RunShare(worker);
+		if (m_Running.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			m_Running.notify_all();
+	}
+}
+
+void BatchRunner::RunShare(int worker)
+{
+	while (true)
+	{
+		uint32_t index;
+		if (TakeNext(worker, index))
+			RunInstance(index);
+		else if (!Steal(worker))
+			return;
+	}
+}
+
+bool BatchRunner::TakeNext(int worker, uint32_t& index)
+{
+	std::atomic<uint64_t>& range = m_Shares[worker].range;
+	uint64_t current = range.load(std::memory_order_acquire);
+	while (true)
+	{
+		uint32_t next = uint32_t(current);
+		uint32_t end = uint32_t(current >> 32);
+		if (next >= end)
+			return false;
+
+		if (range.compare_exchange_weak(current, MakeRange(next + 1, end), std::memory_order_acq_rel, std::memory_order_acquire))
+		{
+			index = next;
+			return true;
+		}
+	}
+}
+
+bool BatchRunner::Steal(int worker)
+{
+	// this one's share is empty, so nobody else can take from it meanwhile
+	int threads = GetThreadCount();
+	for (int i = 1; i < threads; i++)
+	{
+		std::atomic<uint64_t>& range = m_Shares[(worker + i) % threads].range;
+		uint64_t current = range.load(std::memory_order_acquire);
+		while (true)
+		{
+			uint32_t next = uint32_t(current);
+			uint32_t end = uint32_t(current >> 32);
+			if (next >= end)
+				break;
+
+			// the back half, rounded up so a last one can be taken too
+			uint32_t middle = end - (end - next + 1) / 2;
+			if (range.compare_exchange_weak(current, MakeRange(next, middle), std::memory_order_acq_rel, std::memory_order_acquire))
+			{
+				m_Shares[worker].range.store(MakeRange(middle, end), std::memory_order_release);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void BatchRunner::RunInstance(uint32_t index)
+{
+	Emulator& emu = *m_Instances[index];
+
+	// right at the start of the step
+	if (m_Buttons)
+		emu.SetHeldButtons(m_Buttons[index]);
+
+	for (int frame = 0; frame < m_Frames; frame++)
+		emu.Update();
+}
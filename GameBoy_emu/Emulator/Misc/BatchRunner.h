@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+class Emulator;
+
+// Many emulators running the same game, stepped together a few frames at a
+// time on a pool of threads. Every thread starts on its own share of the
+// instances and, once through it, takes half of what's left of somebody
+// else's share, so instances that idle in HALT don't leave threads waiting
+// on the busy ones. The calling thread does its share too
+class BatchRunner
+{
+public:
+	// threads <= 0 is one per core. Pinning puts the pool's own threads
+	// on cores 1, 2, ... and leaves the calling thread where it is
+	BatchRunner(std::string_view romPath, int instances, int threads = 0, bool pinThreads = false);
+	~BatchRunner();
+
+	BatchRunner(const BatchRunner&) = delete;
+	BatchRunner& operator=(const BatchRunner&) = delete;
+
+	// Runs every instance `frames` frames and returns when all are done.
+	// Bit k of buttons[i] is whether key k (as in Emulator::KeyPressed) is
+	// held on instance i from the start of the step, nullptr changes nothing
+	void Step(const uint8_t* buttons, int frames = 1);
+
+	int GetInstanceCount() const;
+	int GetThreadCount() const;
+	// only between steps
+	Emulator& GetInstance(int index);
+
+private:
+	// instances [next, end) not started yet, next in the low half. Owner
+	// and thieves both change it with one compare-exchange
+	struct alignas(64) Share
+	{
+		std::atomic<uint64_t> range{};
+	};
+
+	void WorkerLoop(int worker);
+	// runs instances until there are none left to take anywhere
+	void RunShare(int worker);
+	bool TakeNext(int worker, uint32_t& index);
+	bool Steal(int worker);
+	void RunInstance(uint32_t index);
+
+	std::vector<std::unique_ptr<Emulator>> m_Instances{};
+
+	// the step being run
+	const uint8_t* m_Buttons{};
+	int m_Frames{};
+
+	std::unique_ptr<Share[]> m_Shares{};
+	std::vector<std::thread> m_Threads{};
+	std::atomic<uint32_t> m_Generation{};	// bumped to start a step
+	std::atomic<int> m_Running{};			// threads not done with the step yet
+	std::atomic<bool> m_Stop{};
+};
@@ -0,0 +1,42 @@
+#include "CpuFeatures.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define GB_FEATURES_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+#endif
+
+namespace
+{
+	bool CheckAVX2()
+	{
+#if defined(GB_FEATURES_X86) && defined(_MSC_VER)
+		int info[4]{};
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+
+		// the OS has to save the ymm registers too
+		__cpuid(info, 1);
+		bool osxsave = info[2] & (1 << 27);
+		bool avx = info[2] & (1 << 28);
+		if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+			return false;
+
+		__cpuidex(info, 7, 0);
+		return info[1] & (1 << 5);
+#elif defined(GB_FEATURES_X86)
+		return __builtin_cpu_supports("avx2");
+#else
+		return false;
+#endif
+	}
+}
+
+bool CpuHasAVX2()
+{
+	static const bool avx2 = CheckAVX2();
+	return avx2;
+}
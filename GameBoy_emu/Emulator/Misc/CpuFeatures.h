@@ -0,0 +1,5 @@
+#pragma once
+
+// Instruction sets the host CPU (and OS) can run, for code that picks a
+// vector or a scalar path at runtime. Checked once, then cached
+bool CpuHasAVX2();
@@ -0,0 +1,146 @@
+#include "GymEnv.h"
+#include "PixelKernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+	// the same greys the RGBA frames use, by shade
+	constexpr uint8_t GREYS[4]{ 0xFF, 0xCC, 0x77, 0x00 };
+}
+
+GymEnv::GymEnv(std::string_view romPath, const ObservationSettings& settings)
+	: m_Emulator(std::make_unique<Emulator>())
+	, m_Settings(settings)
+	, m_Shades(144 * 160)
+	, m_Greys(144 * 160)
+	, m_Line(160)
+{
+	m_Settings.width = std::max(m_Settings.width, 1);
+	m_Settings.height = std::max(m_Settings.height, 1);
+	m_Settings.ramSize = std::clamp(m_Settings.ramSize, 0, 0x10000 - m_Settings.ramStart);
+
+	m_Emulator->LoadGame(romPath);
+	m_Emulator->SetFrameBuffer(m_Shades.data(), 160, PixelFormat::SHADE8);
+
+	m_Rows = MakeTaps(144, m_Settings.height);
+	m_Columns = MakeTaps(160, m_Settings.width);
+
+	if (m_Settings.kind == ObservationKind::SCREEN)
+		m_FrameStart = std::make_unique<Emulator::Snapshot>();
+}
+
+void GymEnv::SetRewardHook(RewardHook hook)
+{
+	m_Reward = std::move(hook);
+}
+
+void GymEnv::SetDoneHook(DoneHook hook)
+{
+	m_Done = std::move(hook);
+}
+
+void GymEnv::Reset(uint8_t* observation)
+{
+	m_Emulator->Reset();
+
+	// nothing drawn yet, the screen starts out white
+	std::fill(m_Shades.begin(), m_Shades.end(), 0);
+	Observe(observation);
+}
+
+GymEnv::StepResult GymEnv::Step(uint8_t action, int frameSkip, uint8_t* observation)
+{
+	// right at the start of the step
+	Emulator& emu = *m_Emulator;
+	emu.SetHeldButtons(action);
+
+	StepResult result{};
+	bool screen = m_Settings.kind == ObservationKind::SCREEN;
+	frameSkip = std::max(frameSkip, 1);
+	for (int frame = 1; (frame <= frameSkip) && !result.done; frame++)
+	{
+		// Update() returns in vblank, so the mode applies to exactly this frame.
+		// Only the last is drawn, a done hook may end the step before it though
+		bool last = frame == frameSkip;
+		bool mayEnd = screen && !last && m_Done;
+		if (mayEnd)
+			emu.TakeSnapshot(*m_FrameStart);
+		emu.SetVideoMode((screen && last) ? VideoMode::FULL : VideoMode::TIMING_ONLY);
+		emu.Update();
+
+		if (m_Reward)
+			result.reward += m_Reward(emu);
+		if (m_Done)
+			result.done = m_Done(emu);
+
+		// it did, so the same frame again from its start, drawn this time
+		if (mayEnd && result.done)
+		{
+			emu.RestoreSnapshot(*m_FrameStart);
+			emu.SetVideoMode(VideoMode::FULL);
+			emu.Update();
+		}
+	}
+
+	Observe(observation);
+	return result;
+}
+
+size_t GymEnv::GetObservationSize() const
+{
+	if (m_Settings.kind == ObservationKind::SCREEN)
+		return size_t(m_Settings.width) * m_Settings.height;
+	return m_Settings.ramSize;
+}
+
+Emulator& GymEnv::GetEmulator()
+{
+	return *m_Emulator;
+}
+
+std::vector<GymEnv::Tap> GymEnv::MakeTaps(int from, int to)
+{
+	// bilinear, output pixel centres mapped onto the source ones
+	std::vector<Tap> taps(to);
+	for (int i = 0; i < to; i++)
+	{
+		double source = std::clamp((i + 0.5) * from / to - 0.5, 0.0, double(from - 1));
+		int index = std::min(int(source), from - 2);
+		taps[i] = { index, int(std::lround((source - index) * 256)) };
+	}
+	return taps;
+}
+
+void GymEnv::Observe(uint8_t* observation)
+{
+	if (m_Settings.kind == ObservationKind::SCREEN)
+	{
+		ObserveScreen(observation);
+		return;
+	}
+
+	for (int i = 0; i < m_Settings.ramSize; i++)
+		observation[i] = m_Emulator->PeekMemory(static_cast<WORD>(m_Settings.ramStart + i));
+}
+
+void GymEnv::ObserveScreen(uint8_t* observation)
+{
+	const PixelKernels& kernels = GetPixelKernels();
+	kernels.MapPalette(m_Shades.data(), m_Greys.data(), 144 * 160, GREYS);
+
+	// rows blended whole with the vector kernels, then the few output columns picked from them
+	for (int y = 0; y < m_Settings.height; y++)
+	{
+		const Tap& row = m_Rows[y];
+		kernels.BlendRows(&m_Greys[row.index * 160], &m_Greys[(row.index + 1) * 160], m_Line.data(), 160, row.weight);
+
+		uint8_t* out = observation + y * m_Settings.width;
+		for (int x = 0; x < m_Settings.width; x++)
+		{
+			const Tap& column = m_Columns[x];
+			out[x] = static_cast<uint8_t>((m_Line[column.index] * (256 - column.weight) + m_Line[column.index + 1] * column.weight + 128) >> 8);
+		}
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "../Emulator.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// What GymEnv writes into the caller's buffer after every step
+enum class ObservationKind
+{
+	SCREEN,	// width x height greys, 0 black to 255 white, scaled from the 160x144 frame
+	RAM,	// ramSize bytes from ramStart on, as the CPU would read them
+};
+
+struct ObservationSettings
+{
+	ObservationKind kind{ ObservationKind::SCREEN };
+	int width{ 84 };
+	int height{ 84 };
+	WORD ramStart{ 0xC000 };
+	int ramSize{ 0x2000 };
+};
+
+// One game as an environment for reinforcement learning. An action is the
+// buttons to hold for a few frames, what comes back is the reward a hook
+// makes of them, whether the episode is over, and the observation.
+// Only SCREEN observations draw frames, and only the last frame of each
+// step. A step the done hook ends early runs its last frame a second time,
+// from a snapshot, to draw it
+class GymEnv
+{
+public:
+	// called after every frame, the reward for it and whether the episode ended with it
+	using RewardHook = std::function<float(const Emulator&)>;
+	using DoneHook = std::function<bool(const Emulator&)>;
+
+	struct StepResult
+	{
+		float reward;	// added up over the frames of the step
+		bool done;
+	};
+
+	GymEnv(std::string_view romPath, const ObservationSettings& settings = {});
+
+	void SetRewardHook(RewardHook hook);
+	void SetDoneHook(DoneHook hook);
+
+	// back to the state right after loading, writes the first observation
+	void Reset(uint8_t* observation);
+	// Holds `action` (bit k = key k, as in Emulator::KeyPressed) for frameSkip
+	// frames, fewer if the episode ends first. The observation is of the
+	// step's last frame
+	StepResult Step(uint8_t action, int frameSkip, uint8_t* observation);
+
+	// bytes Reset() and Step() write
+	size_t GetObservationSize() const;
+	Emulator& GetEmulator();
+
+private:
+	// output pixel i is source pixel `index` blended with the next by `weight` 256ths
+	struct Tap
+	{
+		int index;
+		int weight;
+	};
+
+	static std::vector<Tap> MakeTaps(int from, int to);
+	void Observe(uint8_t* observation);
+	void ObserveScreen(uint8_t* observation);
+
+	std::unique_ptr<Emulator> m_Emulator;
+	ObservationSettings m_Settings;
+	RewardHook m_Reward{};
+	DoneHook m_Done{};
+	// where the frame being run started, SCREEN only
+	std::unique_ptr<Emulator::Snapshot> m_FrameStart{};
+
+	// the frame as SHADE8, what it looks like in greys, one row scaled vertically
+	std::vector<BYTE> m_Shades;
+	std::vector<BYTE> m_Greys;
+	std::vector<BYTE> m_Line;
+	std::vector<Tap> m_Rows{};
+	std::vector<Tap> m_Columns{};
+};
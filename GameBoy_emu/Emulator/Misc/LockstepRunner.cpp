@@ -0,0 +1,51 @@
+#include "LockstepRunner.h"
+
+#include <algorithm>
+
+LockstepRunner::LockstepRunner(std::string_view romPath, int lanes)
+{
+	// loaded once, the rest share the cartridge and its code
+	auto first = std::make_unique<Emulator>();
+	first->LoadGame(romPath);
+	m_Emulators.reserve(std::max(lanes, 1));
+	for (int lane = 1; lane < lanes; lane++)
+		m_Emulators.push_back(first->Fork());
+	m_Emulators.insert(m_Emulators.begin(), std::move(first));
+
+	for (const std::unique_ptr<Emulator>& emu : m_Emulators)
+		m_Lanes.push_back(emu.get());
+}
+
+void LockstepRunner::Step(const uint8_t* buttons)
+{
+	if (buttons)
+	{
+		for (int lane = 0; lane < GetLaneCount(); lane++)
+			m_Lanes[lane]->SetHeldButtons(buttons[lane]);
+	}
+
+	Emulator::LockstepCounts counts = Emulator::UpdateLockstep(m_Lanes.data(), GetLaneCount());
+	m_Counts.steps += counts.steps;
+	m_Counts.together += counts.together;
+}
+
+void LockstepRunner::SetVideoMode(VideoMode mode)
+{
+	for (Emulator* emu : m_Lanes)
+		emu->SetVideoMode(mode);
+}
+
+int LockstepRunner::GetLaneCount() const
+{
+	return static_cast<int>(m_Lanes.size());
+}
+
+Emulator& LockstepRunner::GetLane(int lane)
+{
+	return *m_Lanes[lane];
+}
+
+const Emulator::LockstepCounts& LockstepRunner::GetCounts() const
+{
+	return m_Counts;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "../Emulator.h"
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Experimental: N copies (lanes) of one game stepped a frame at a time
+// through Emulator::UpdateLockstep(), so lanes at the same place in the
+// game run their instructions together. Lanes drift apart as they're given
+// different buttons and run alone where they do, but stay where Update()
+// would have taken them either way
+class LockstepRunner
+{
+public:
+	LockstepRunner(std::string_view romPath, int lanes);
+
+	LockstepRunner(const LockstepRunner&) = delete;
+	LockstepRunner& operator=(const LockstepRunner&) = delete;
+
+	// One frame on every lane. Bit k of buttons[lane] is whether key k is
+	// held from the start of the frame, nullptr changes nothing
+	void Step(const uint8_t* buttons);
+
+	void SetVideoMode(VideoMode mode);
+
+	int GetLaneCount() const;
+	// only between steps
+	Emulator& GetLane(int lane);
+	// added up over every step so far
+	const Emulator::LockstepCounts& GetCounts() const;
+
+private:
+	std::vector<std::unique_ptr<Emulator>> m_Emulators{};
+	std::vector<Emulator*> m_Lanes{};
+	Emulator::LockstepCounts m_Counts{};
+};
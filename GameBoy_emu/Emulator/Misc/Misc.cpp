@@ -5,7 +5,7 @@ void Emulator::DoDMATransfer(BYTE data)
     WORD address = data << 8; // source address is data * 100
     for (int i = 0; i < 0xA0; i++)
     {
-        WriteMemory(0xFE00 + i, ReadMemory(address + i));
+        VideoWrite(0xFE00 + i, ReadMemory(address + i));
     }
 }
 
@@ -0,0 +1,199 @@
+#include "Movie.h"
+#include "../Emulator.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+	// bump whenever the layout below changes
+	constexpr uint32_t MOVIE_VERSION = 1;
+	constexpr char MOVIE_MAGIC[4]{ 'G', 'B', 'M', 'V' };
+
+	// followed by the start state, then per frame: the number of inputs,
+	// each input's offset and key (bit 7 set for a press), and the state hash
+	struct MovieHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t romHash;
+		uint32_t frames;
+		uint32_t stateSize;
+	};
+
+	void WriteCount(std::vector<uint8_t>& out, uint32_t value)
+	{
+		for (; value >= 0x80; value >>= 7)
+			out.push_back(static_cast<uint8_t>(value | 0x80));
+		out.push_back(static_cast<uint8_t>(value));
+	}
+
+	bool ReadCount(const uint8_t*& in, const uint8_t* end, uint32_t& value)
+	{
+		value = 0;
+		for (int shift = 0; (in < end) && (shift < 32); shift += 7)
+		{
+			uint8_t byte = *in++;
+			value |= uint32_t(byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+				return true;
+		}
+		return false;
+	}
+}
+
+void Movie::StartRecording(const Emulator& emu)
+{
+	m_RomHash = emu.GetRomHash();
+	m_Inputs.clear();
+	m_FrameInputs.assign(1, 0);
+	m_Hashes.clear();
+	m_StartState.clear();
+
+	if (emu.GetCycleCount() != 0)
+	{
+		auto snapshot = std::make_unique<Emulator::Snapshot>();
+		emu.TakeSnapshot(*snapshot);
+		emu.SaveState(*snapshot, m_StartState);
+	}
+}
+
+void Movie::Queue(Emulator& emu, uint64_t cycle, int key, bool pressed)
+{
+	// anything already due lands right at the start of the frame, in a replay too
+	uint64_t offset = cycle - std::min(cycle, emu.GetCycleCount());
+	m_Inputs.push_back({ static_cast<uint32_t>(offset), static_cast<uint8_t>(key), pressed });
+	emu.QueueInput(cycle, key, pressed);
+}
+
+void Movie::FrameDone(const Emulator& emu)
+{
+	m_FrameInputs.push_back(static_cast<uint32_t>(m_Inputs.size()));
+	m_Hashes.push_back(FoldHash(emu.GetStateHash()));
+}
+
+bool Movie::StartPlayback(Emulator& emu) const
+{
+	if (emu.GetRomHash() != m_RomHash)
+		return false;
+
+	if (m_StartState.empty())
+		return emu.GetCycleCount() == 0;
+
+	auto snapshot = std::make_unique<Emulator::Snapshot>();
+	if (!emu.LoadState(m_StartState.data(), m_StartState.size(), *snapshot))
+		return false;
+	emu.RestoreSnapshot(*snapshot);
+	return true;
+}
+
+void Movie::QueueFrame(Emulator& emu, size_t frame) const
+{
+	uint64_t start = emu.GetCycleCount();
+	for (uint32_t i = m_FrameInputs[frame]; i < m_FrameInputs[frame + 1]; i++)
+		emu.QueueInput(start + m_Inputs[i].offset, m_Inputs[i].key, m_Inputs[i].pressed);
+}
+
+bool Movie::CheckFrame(const Emulator& emu, size_t frame) const
+{
+	return m_Hashes[frame] == FoldHash(emu.GetStateHash());
+}
+
+size_t Movie::GetFrameCount() const
+{
+	return m_Hashes.size();
+}
+
+void Movie::Save(std::vector<uint8_t>& data) const
+{
+	MovieHeader header{};
+	std::memcpy(header.magic, MOVIE_MAGIC, sizeof(header.magic));
+	header.version = MOVIE_VERSION;
+	header.romHash = m_RomHash;
+	header.frames = static_cast<uint32_t>(m_Hashes.size());
+	header.stateSize = static_cast<uint32_t>(m_StartState.size());
+
+	data.resize(sizeof(header));
+	std::memcpy(data.data(), &header, sizeof(header));
+	data.insert(data.end(), m_StartState.begin(), m_StartState.end());
+
+	for (size_t frame = 0; frame < m_Hashes.size(); frame++)
+	{
+		WriteCount(data, m_FrameInputs[frame + 1] - m_FrameInputs[frame]);
+		for (uint32_t i = m_FrameInputs[frame]; i < m_FrameInputs[frame + 1]; i++)
+		{
+			WriteCount(data, m_Inputs[i].offset);
+			data.push_back(m_Inputs[i].key | (m_Inputs[i].pressed ? 0x80 : 0));
+		}
+
+		uint8_t hash[4];
+		std::memcpy(hash, &m_Hashes[frame], sizeof(hash));
+		data.insert(data.end(), hash, hash + sizeof(hash));
+	}
+}
+
+bool Movie::Load(const uint8_t* data, size_t size)
+{
+	MovieHeader header;
+	if (size < sizeof(header))
+		return false;
+	std::memcpy(&header, data, sizeof(header));
+
+	if ((std::memcmp(header.magic, MOVIE_MAGIC, sizeof(header.magic)) != 0) ||
+		(header.version != MOVIE_VERSION) ||
+		(size - sizeof(header) < header.stateSize))
+		return false;
+
+	const uint8_t* in = data + sizeof(header);
+	const uint8_t* end = data + size;
+	std::vector<uint8_t> startState(in, in + header.stateSize);
+	in += header.stateSize;
+
+	std::vector<Input> inputs{};
+	std::vector<uint32_t> frameInputs{ 0 };
+	std::vector<uint32_t> hashes{};
+	for (uint32_t frame = 0; frame < header.frames; frame++)
+	{
+		uint32_t count;
+		if (!ReadCount(in, end, count))
+			return false;
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint32_t offset;
+			if (!ReadCount(in, end, offset) || (in == end))
+				return false;
+			// bit 7 is the press, only keys 0-7 exist
+			uint8_t key = *in++;
+			if ((key & 0x7F) > 7)
+				return false;
+			inputs.push_back({ offset, static_cast<uint8_t>(key & 0x7F), (key & 0x80) != 0 });
+		}
+
+		uint32_t hash;
+		if (end - in < static_cast<ptrdiff_t>(sizeof(hash)))
+			return false;
+		std::memcpy(&hash, in, sizeof(hash));
+		in += sizeof(hash);
+
+		frameInputs.push_back(static_cast<uint32_t>(inputs.size()));
+		hashes.push_back(hash);
+	}
+
+	// anything left over means it isn't what it says it is, and nothing changes
+	if (in != end)
+		return false;
+
+	m_RomHash = header.romHash;
+	m_StartState = std::move(startState);
+	m_Inputs = std::move(inputs);
+	m_FrameInputs = std::move(frameInputs);
+	m_Hashes = std::move(hashes);
+	return true;
+}
+
+uint32_t Movie::FoldHash(uint64_t hash)
+{
+	// half the size, still plenty to notice a difference
+	return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
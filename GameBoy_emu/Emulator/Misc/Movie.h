@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class Emulator;
+
+// Joypad input frame by frame, recorded from one run and played back into
+// another exactly as it happened. Every input keeps the cycle it landed on
+// within its frame, and every frame the hash of the state after it, so a
+// replay that goes its own way is caught on the frame it happens. A movie
+// starts at power on, or from a save state it carries along
+class Movie
+{
+public:
+	// recording, Queue() stands in for Emulator::QueueInput. Starts at
+	// power on if the emulator hasn't run yet, from a save state otherwise
+	void StartRecording(const Emulator& emu);
+	void Queue(Emulator& emu, uint64_t cycle, int key, bool pressed);
+	void FrameDone(const Emulator& emu);
+
+	// playing back, false if the movie is for another game, or starts
+	// at power on and the emulator has already run
+	bool StartPlayback(Emulator& emu) const;
+	// queues the input of `frame` (0 = the first), call right before its Update()
+	void QueueFrame(Emulator& emu, size_t frame) const;
+	// whether the state after `frame` is the recorded one
+	bool CheckFrame(const Emulator& emu, size_t frame) const;
+
+	size_t GetFrameCount() const;
+
+	void Save(std::vector<uint8_t>& data) const;
+	bool Load(const uint8_t* data, size_t size);
+
+private:
+	struct Input
+	{
+		uint32_t offset;	// cycles after the start of the frame
+		uint8_t key;
+		bool pressed;
+	};
+
+	static uint32_t FoldHash(uint64_t hash);
+
+	uint64_t m_RomHash{};
+	std::vector<uint8_t> m_StartState{};	// empty for power on
+
+	std::vector<Input> m_Inputs{};
+	// where each frame's inputs start in m_Inputs, one more than there are frames
+	std::vector<uint32_t> m_FrameInputs{ 0 };
+	std::vector<uint32_t> m_Hashes{};
+};
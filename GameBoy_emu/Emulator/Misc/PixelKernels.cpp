@@ -0,0 +1,235 @@
+#include "PixelKernels.h"
+#include "CpuFeatures.h"
+
+#include <array>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define GB_KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define GB_TARGET(isa)
+#else
+#define GB_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+static_assert(std::endian::native == std::endian::little,
+	"tile row decoding stores 8 colour ids as one little endian word");
+
+namespace
+{
+	// spreads the 8 bits of a bitplane byte over 8 bytes,
+	// bit 7 (leftmost pixel) lands in the lowest byte
+	constexpr std::array<uint64_t, 256> MakeSpreadTable()
+	{
+		std::array<uint64_t, 256> table{};
+		for (int value = 0; value < 256; ++value)
+			for (int pixel = 0; pixel < 8; ++pixel)
+				if (value & (0x80 >> pixel))
+					table[value] |= uint64_t{ 1 } << (pixel * 8);
+		return table;
+	}
+
+	constexpr std::array<uint64_t, 256> SPREAD{ MakeSpreadTable() };
+
+	void DecodeTileRowsScalar(const uint8_t* planes, uint8_t* out, int tiles)
+	{
+		for (int tile = 0; tile < tiles; ++tile)
+		{
+			uint64_t ids = SPREAD[planes[tile * 2]] | (SPREAD[planes[tile * 2 + 1]] << 1);
+			std::memcpy(out + tile * 8, &ids, 8);
+		}
+	}
+
+	void MapPaletteScalar(const uint8_t* ids, uint8_t* out, int count, const uint8_t* palette)
+	{
+		for (int i = 0; i < count; ++i)
+			out[i] = palette[ids[i] & 0x3];
+	}
+
+	void BlendRowsScalar(const uint8_t* a, const uint8_t* b, uint8_t* out, int count, int weight)
+	{
+		for (int i = 0; i < count; ++i)
+			out[i] = static_cast<uint8_t>((a[i] * (256 - weight) + b[i] * weight + 128) >> 8);
+	}
+
+#ifdef GB_KERNELS_X86
+	constexpr int64_t Splat(uint8_t value)
+	{
+		return static_cast<int64_t>(value * 0x0101010101010101ULL);
+	}
+
+	GB_TARGET("sse2")
+	void DecodeTileRowsSSE2(const uint8_t* planes, uint8_t* out, int tiles)
+	{
+		// one mask bit per pixel, leftmost pixel first
+		const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+		const __m128i one = _mm_set1_epi8(1);
+		const __m128i two = _mm_set1_epi8(2);
+
+		int tile = 0;
+		for (; tile + 2 <= tiles; tile += 2)
+		{
+			const uint8_t* p = planes + tile * 2;
+			__m128i lo = _mm_set_epi64x(Splat(p[2]), Splat(p[0]));
+			__m128i hi = _mm_set_epi64x(Splat(p[3]), Splat(p[1]));
+			lo = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lo, bits), bits), one);
+			hi = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(hi, bits), bits), two);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + tile * 8), _mm_or_si128(lo, hi));
+		}
+
+		DecodeTileRowsScalar(planes + tile * 2, out + tile * 8, tiles - tile);
+	}
+
+	GB_TARGET("sse2")
+	void MapPaletteSSE2(const uint8_t* ids, uint8_t* out, int count, const uint8_t* palette)
+	{
+		// no byte shuffle before SSSE3, select each entry with a compare instead
+		const __m128i p0 = _mm_set1_epi8(static_cast<char>(palette[0]));
+		const __m128i p1 = _mm_set1_epi8(static_cast<char>(palette[1]));
+		const __m128i p2 = _mm_set1_epi8(static_cast<char>(palette[2]));
+		const __m128i p3 = _mm_set1_epi8(static_cast<char>(palette[3]));
+
+		int i = 0;
+		for (; i + 16 <= count; i += 16)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ids + i));
+			__m128i res = _mm_and_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()), p0);
+			res = _mm_or_si128(res, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(1)), p1));
+			res = _mm_or_si128(res, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(2)), p2));
+			res = _mm_or_si128(res, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(3)), p3));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), res);
+		}
+
+		MapPaletteScalar(ids + i, out + i, count - i, palette);
+	}
+
+	GB_TARGET("sse2")
+	void BlendRowsSSE2(const uint8_t* a, const uint8_t* b, uint8_t* out, int count, int weight)
+	{
+		// the weighted sum is at most 255 * 256 + 128, it fits 16 bits unsigned
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i weightA = _mm_set1_epi16(static_cast<short>(256 - weight));
+		const __m128i weightB = _mm_set1_epi16(static_cast<short>(weight));
+		const __m128i round = _mm_set1_epi16(128);
+
+		int i = 0;
+		for (; i + 16 <= count; i += 16)
+		{
+			__m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+			__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+			__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), weightA),
+				_mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), weightB));
+			__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), weightA),
+				_mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), weightB));
+			lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+			hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+		}
+
+		BlendRowsScalar(a + i, b + i, out + i, count - i, weight);
+	}
+
+	GB_TARGET("avx2")
+	void DecodeTileRowsAVX2(const uint8_t* planes, uint8_t* out, int tiles)
+	{
+		const __m256i bits = _mm256_set1_epi64x(0x0102040810204080LL);
+		const __m256i one = _mm256_set1_epi8(1);
+		const __m256i two = _mm256_set1_epi8(2);
+
+		int tile = 0;
+		for (; tile + 4 <= tiles; tile += 4)
+		{
+			const uint8_t* p = planes + tile * 2;
+			__m256i lo = _mm256_set_epi64x(Splat(p[6]), Splat(p[4]), Splat(p[2]), Splat(p[0]));
+			__m256i hi = _mm256_set_epi64x(Splat(p[7]), Splat(p[5]), Splat(p[3]), Splat(p[1]));
+			lo = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lo, bits), bits), one);
+			hi = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(hi, bits), bits), two);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + tile * 8), _mm256_or_si256(lo, hi));
+		}
+
+		DecodeTileRowsSSE2(planes + tile * 2, out + tile * 8, tiles - tile);
+	}
+
+	GB_TARGET("avx2")
+	void MapPaletteAVX2(const uint8_t* ids, uint8_t* out, int count, const uint8_t* palette)
+	{
+		// every 4 byte group holds the palette so ids 0-3 shuffle straight into it
+		uint32_t packed{};
+		std::memcpy(&packed, palette, 4);
+		const __m256i table = _mm256_set1_epi32(static_cast<int>(packed));
+
+		int i = 0;
+		for (; i + 32 <= count; i += 32)
+		{
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ids + i));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_shuffle_epi8(table, v));
+		}
+
+		MapPaletteSSE2(ids + i, out + i, count - i, palette);
+	}
+
+	GB_TARGET("avx2")
+	void BlendRowsAVX2(const uint8_t* a, const uint8_t* b, uint8_t* out, int count, int weight)
+	{
+		// unpacking and packing both stay within 128 bit lanes, so the order comes out right
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i weightA = _mm256_set1_epi16(static_cast<short>(256 - weight));
+		const __m256i weightB = _mm256_set1_epi16(static_cast<short>(weight));
+		const __m256i round = _mm256_set1_epi16(128);
+
+		int i = 0;
+		for (; i + 32 <= count; i += 32)
+		{
+			__m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+			__m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+			__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(va, zero), weightA),
+				_mm256_mullo_epi16(_mm256_unpacklo_epi8(vb, zero), weightB));
+			__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(va, zero), weightA),
+				_mm256_mullo_epi16(_mm256_unpackhi_epi8(vb, zero), weightB));
+			lo = _mm256_srli_epi16(_mm256_add_epi16(lo, round), 8);
+			hi = _mm256_srli_epi16(_mm256_add_epi16(hi, round), 8);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_packus_epi16(lo, hi));
+		}
+
+		BlendRowsSSE2(a + i, b + i, out + i, count - i, weight);
+	}
+#endif // GB_KERNELS_X86
+
+	constexpr PixelKernels SCALAR_KERNELS{ KernelLevel::SCALAR, "scalar", DecodeTileRowsScalar, MapPaletteScalar, BlendRowsScalar };
+#ifdef GB_KERNELS_X86
+	constexpr PixelKernels SSE2_KERNELS{ KernelLevel::SSE2, "sse2", DecodeTileRowsSSE2, MapPaletteSSE2, BlendRowsSSE2 };
+	constexpr PixelKernels AVX2_KERNELS{ KernelLevel::AVX2, "avx2", DecodeTileRowsAVX2, MapPaletteAVX2, BlendRowsAVX2 };
+#endif
+}
+
+const PixelKernels* GetPixelKernels(KernelLevel level)
+{
+	switch (level)
+	{
+	case KernelLevel::SCALAR:
+		return &SCALAR_KERNELS;
+#ifdef GB_KERNELS_X86
+	case KernelLevel::SSE2:
+		return &SSE2_KERNELS;
+	case KernelLevel::AVX2:
+		return CpuHasAVX2() ? &AVX2_KERNELS : nullptr;
+#endif
+	default:
+		return nullptr;
+	}
+}
+
+const PixelKernels& GetPixelKernels()
+{
+	static const PixelKernels& kernels = []() -> const PixelKernels& {
+		for (KernelLevel level : { KernelLevel::AVX2, KernelLevel::SSE2 })
+			if (const PixelKernels* k = GetPixelKernels(level))
+				return *k;
+		return SCALAR_KERNELS;
+	}();
+
+	return kernels;
+}
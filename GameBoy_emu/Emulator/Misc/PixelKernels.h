@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+
+// Tile row decoding and palette mapping used by the scanline renderer,
+// and row blending for scaling frames down.
+// Every level produces identical output, the best one the host CPU
+// supports is picked once at startup.
+enum class KernelLevel
+{
+	SCALAR,
+	SSE2,
+	AVX2,
+};
+
+struct PixelKernels
+{
+	KernelLevel level;
+	const char* name;
+
+	// planes holds `tiles` tile rows as (lo, hi) byte pairs,
+	// out receives 8 colour ids (0-3) per tile, leftmost pixel first
+	void (*DecodeTileRows)(const uint8_t* planes, uint8_t* out, int tiles);
+
+	// maps `count` colour ids through a 4 entry palette
+	void (*MapPalette)(const uint8_t* ids, uint8_t* out, int count, const uint8_t* palette);
+
+	// out = a + (b - a) * weight / 256, rounded, for `count` bytes. weight is 0-256
+	void (*BlendRows)(const uint8_t* a, const uint8_t* b, uint8_t* out, int count, int weight);
+};
+
+// kernels picked for this CPU
+const PixelKernels& GetPixelKernels();
+
+// kernels of a specific level, nullptr if the CPU can't run them
+const PixelKernels* GetPixelKernels(KernelLevel level);
@@ -0,0 +1,228 @@
+#include "RewindBuffer.h"
+
+#include <cstring>
+
+namespace
+{
+	// the shortest stretch of unchanged bytes worth ending a run for,
+	// anything shorter costs more in run headers than it saves
+	constexpr size_t MIN_GAP = 8;
+
+	// first position from `pos` on where a and b differ
+	size_t SkipEqual(const uint8_t* a, const uint8_t* b, size_t pos, size_t size)
+	{
+		// 8 bytes at a time through the long unchanged stretches
+		for (; pos + 8 <= size; pos += 8)
+		{
+			uint64_t wordA, wordB;
+			std::memcpy(&wordA, a + pos, 8);
+			std::memcpy(&wordB, b + pos, 8);
+			if (wordA != wordB)
+				break;
+		}
+
+		while ((pos < size) && (a[pos] == b[pos]))
+			pos++;
+		return pos;
+	}
+
+	void WriteCount(std::vector<uint8_t>& out, size_t value)
+	{
+		for (; value >= 0x80; value >>= 7)
+			out.push_back(static_cast<uint8_t>(value | 0x80));
+		out.push_back(static_cast<uint8_t>(value));
+	}
+
+	size_t ReadCount(const uint8_t*& in)
+	{
+		size_t value = 0;
+		for (int shift = 0;; shift += 7)
+		{
+			uint8_t byte = *in++;
+			value |= size_t(byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+				return value;
+		}
+	}
+}
+
+RewindBuffer::RewindBuffer(size_t stateSize, size_t capacity, int keyInterval)
+	: m_StateSize(stateSize)
+	, m_Capacity(capacity)
+	, m_KeyInterval(keyInterval)
+	, m_Ring(std::make_unique<uint8_t[]>(capacity))
+	, m_Key(std::make_unique<uint8_t[]>(stateSize))
+	, m_Zeros(std::make_unique<uint8_t[]>(stateSize))
+{
+	m_Scratch.reserve(stateSize);
+}
+
+void RewindBuffer::Push(const uint8_t* state)
+{
+	bool keyframe = m_Entries.empty() || (m_SinceKey >= m_KeyInterval);
+	Encode(state, keyframe ? m_Zeros.get() : m_Key.get());
+
+	MakeRoom(m_Scratch.size());
+
+	// the keyframe this was stored against got pushed out, so it has to be one itself
+	if (!keyframe && m_Entries.empty())
+	{
+		keyframe = true;
+		Encode(state, m_Zeros.get());
+		MakeRoom(m_Scratch.size());
+	}
+
+	// doesn't fit at all
+	if (m_Scratch.size() > m_Capacity)
+		return;
+
+	std::memcpy(m_Ring.get() + m_Head, m_Scratch.data(), m_Scratch.size());
+	m_Entries.push_back({ m_Head, m_Scratch.size(), keyframe });
+	m_Head += m_Scratch.size();
+	m_Used += m_Scratch.size();
+
+	if (keyframe)
+	{
+		std::memcpy(m_Key.get(), state, m_StateSize);
+		m_SinceKey = 0;
+	}
+	m_SinceKey++;
+}
+
+bool RewindBuffer::Pop(uint8_t* state)
+{
+	if (m_Entries.empty())
+		return false;
+
+	Entry entry = m_Entries.back();
+	std::memcpy(state, entry.keyframe ? m_Zeros.get() : m_Key.get(), m_StateSize);
+	Apply(entry, state);
+
+	m_Entries.pop_back();
+	m_Head = entry.offset;
+	m_Used -= entry.size;
+	m_SinceKey--;
+
+	// back into the previous group, unpack its keyframe again
+	if ((m_SinceKey == 0) && !m_Entries.empty())
+	{
+		size_t key = m_Entries.size() - 1;
+		while (!m_Entries[key].keyframe)
+			key--;
+
+		std::memset(m_Key.get(), 0, m_StateSize);
+		Apply(m_Entries[key], m_Key.get());
+		m_SinceKey = static_cast<int>(m_Entries.size() - key);
+	}
+	return true;
+}
+
+void RewindBuffer::Clear()
+{
+	m_Entries.clear();
+	m_Head = 0;
+	m_Used = 0;
+	m_SinceKey = 0;
+}
+
+size_t RewindBuffer::GetFrames() const
+{
+	return m_Entries.size();
+}
+
+size_t RewindBuffer::GetBytesUsed() const
+{
+	return m_Used;
+}
+
+void RewindBuffer::Encode(const uint8_t* state, const uint8_t* base)
+{
+	// runs of (unchanged count, changed count, changed bytes XOR base)
+	m_Scratch.clear();
+	size_t last = 0;
+	size_t pos = SkipEqual(state, base, 0, m_StateSize);
+
+	while (pos < m_StateSize)
+	{
+		// the run goes on until the next long enough unchanged stretch
+		size_t end = pos;
+		while (end < m_StateSize)
+		{
+			if (state[end] != base[end])
+			{
+				end++;
+				continue;
+			}
+
+			size_t equalEnd = SkipEqual(state, base, end, m_StateSize);
+			if ((equalEnd - end >= MIN_GAP) || (equalEnd == m_StateSize))
+				break;
+			end = equalEnd;
+		}
+
+		WriteCount(m_Scratch, pos - last);
+		WriteCount(m_Scratch, end - pos);
+		for (size_t i = pos; i < end; i++)
+			m_Scratch.push_back(state[i] ^ base[i]);
+
+		last = end;
+		pos = SkipEqual(state, base, end, m_StateSize);
+	}
+
+	// nothing changed, still takes up a byte or two so every entry has its own place
+	if (m_Scratch.empty())
+	{
+		WriteCount(m_Scratch, 0);
+		WriteCount(m_Scratch, 0);
+	}
+}
+
+void RewindBuffer::Apply(const Entry& entry, uint8_t* state) const
+{
+	const uint8_t* in = m_Ring.get() + entry.offset;
+	const uint8_t* end = in + entry.size;
+
+	size_t pos = 0;
+	while (in < end)
+	{
+		pos += ReadCount(in);
+		size_t count = ReadCount(in);
+		for (size_t i = 0; i < count; i++)
+			state[pos + i] ^= in[i];
+		in += count;
+		pos += count;
+	}
+}
+
+void RewindBuffer::MakeRoom(size_t size)
+{
+	if (size > m_Capacity)
+	{
+		Clear();
+		return;
+	}
+
+	// no space left before the end, whatever is still there is the oldest
+	if (m_Head + size > m_Capacity)
+	{
+		while (!m_Entries.empty() && (m_Entries.front().offset >= m_Head))
+			DropOldestGroup();
+		m_Head = 0;
+	}
+
+	// the oldest entries are the ones right after the newest
+	while (!m_Entries.empty() && (m_Entries.front().offset >= m_Head) && (m_Entries.front().offset < m_Head + size))
+		DropOldestGroup();
+}
+
+void RewindBuffer::DropOldestGroup()
+{
+	do
+	{
+		m_Used -= m_Entries.front().size;
+		m_Entries.pop_front();
+	} while (!m_Entries.empty() && !m_Entries.front().keyframe);
+
+	if (m_Entries.empty())
+		m_SinceKey = 0;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+// History of fixed size states in a fixed size block of memory, newest
+// first out. Every `keyInterval` states a keyframe is stored, the ones in
+// between only as the bytes that differ from it (XORed, run length coded).
+// When it's full the oldest keyframe goes, along with everything that needs it
+class RewindBuffer
+{
+public:
+	RewindBuffer(size_t stateSize, size_t capacity, int keyInterval = 60);
+
+	void Push(const uint8_t* state);
+	// takes the newest state back out, false if there's none left
+	bool Pop(uint8_t* state);
+	void Clear();
+
+	size_t GetFrames() const;
+	size_t GetBytesUsed() const;
+
+private:
+	struct Entry
+	{
+		size_t offset;
+		size_t size;
+		bool keyframe;
+	};
+
+	void Encode(const uint8_t* state, const uint8_t* base);
+	void Apply(const Entry& entry, uint8_t* state) const;
+	// frees `size` bytes at m_Head, dropping the oldest groups in the way
+	void MakeRoom(size_t size);
+	void DropOldestGroup();
+
+	size_t m_StateSize;
+	size_t m_Capacity;
+	int m_KeyInterval;
+
+	std::unique_ptr<uint8_t[]> m_Ring;
+	size_t m_Head{};
+	size_t m_Used{};
+	std::deque<Entry> m_Entries{};
+
+	// the keyframe the newest states are stored against, and how many go with it
+	std::unique_ptr<uint8_t[]> m_Key;
+	int m_SinceKey{};
+
+	std::unique_ptr<uint8_t[]> m_Zeros;
+	std::vector<uint8_t> m_Scratch{};
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// Fixed size lock-free queue for exactly one producer and one consumer thread.
+// Neither side ever blocks, TryPush/TryPop fail when the queue is full/empty
+template< typename T, size_t Capacity >
+class SpscQueue
+{
+	static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+	bool TryPush(const T& item)
+	{
+		size_t tail = m_Tail.load(std::memory_order_relaxed);
+		if (tail - m_CachedHead == Capacity)
+		{
+			m_CachedHead = m_Head.load(std::memory_order_acquire);
+			if (tail - m_CachedHead == Capacity)
+				return false;
+		}
+
+		m_Items[tail & (Capacity - 1)] = item;
+		m_Tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool TryPop(T& item)
+	{
+		size_t head = m_Head.load(std::memory_order_relaxed);
+		if (head == m_CachedTail)
+		{
+			m_CachedTail = m_Tail.load(std::memory_order_acquire);
+			if (head == m_CachedTail)
+				return false;
+		}
+
+		item = m_Items[head & (Capacity - 1)];
+		m_Head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::array<T, Capacity> m_Items{};
+
+	// each side keeps its own index and a cached copy of the other one
+	// on separate cache lines so they don't fight over them
+	alignas(64) std::atomic<size_t> m_Head{};
+	size_t m_CachedTail{};
+	alignas(64) std::atomic<size_t> m_Tail{};
+	size_t m_CachedHead{};
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Lock-free handoff of the latest value from exactly one writer thread to one
+// reader thread. The writer fills Back() and publishes it, the reader picks up
+// the newest published buffer. Neither side ever waits, values the reader was
+// too slow for are simply replaced
+template< typename T >
+class TripleBuffer
+{
+public:
+	// writer side
+	T& Back()
+	{
+		return m_Buffers[m_Back];
+	}
+
+	void Publish()
+	{
+		// swap the finished buffer into the middle and carry on with the old middle one
+		m_Back = m_Middle.exchange(m_Back | FRESH, std::memory_order_acq_rel) & INDEX;
+	}
+
+	// reader side, true if something newer than Front() got published
+	bool Update()
+	{
+		if (!(m_Middle.load(std::memory_order_relaxed) & FRESH))
+			return false;
+
+		m_Front = m_Middle.exchange(m_Front, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+
+	const T& Front() const
+	{
+		return m_Buffers[m_Front];
+	}
+
+private:
+	static constexpr uint8_t INDEX{ 0x3 };
+	static constexpr uint8_t FRESH{ 0x4 };
+
+	std::array<T, 3> m_Buffers{};
+
+	// each index is only touched by its own side, the middle one is
+	// swapped through atomically and says whether it's been read yet
+	int m_Back{ 0 };
+	alignas(64) std::atomic<uint8_t> m_Middle{ 1 };
+	alignas(64) int m_Front{ 2 };
+};
@@ -0,0 +1,398 @@
+#include "Emulator.h"
+#include "Misc/BitOps.h"
+
+void Emulator::SetPpuBackend(PpuBackend backend)
+{
+    if (backend == m_PpuBackend)
+        return;
+
+    if (backend == PpuBackend::FIFO)
+    {
+        // the FIFO reads memory as the dots go by, it can't work from the log
+        SetRenderThread(false);
+
+        // pick up at the start of the current line
+        int windowLine = m_Fifo.windowLine;
+        m_Fifo = {};
+        m_Fifo.windowLine = windowLine;
+        m_Fifo.lcdOff = !IsLCDEnabled();
+        m_PpuBackend = backend;
+        if (!m_Fifo.lcdOff)
+            StartFifoLine();
+    }
+    else
+    {
+        m_ScanlineCounter = 456 - m_Fifo.dot;
+        m_PpuBackend = backend;
+    }
+}
+
+PpuBackend Emulator::GetPpuBackend() const
+{
+    return m_PpuBackend;
+}
+
+void Emulator::UpdateFifo(int cycles)
+{
+    if (!IsLCDEnabled())
+    {
+        // same as the scanline PPU, LY held at 0 and mode 1
+        SetLCDStatus();
+        m_Fifo.lcdOff = true;
+        return;
+    }
+
+    // switched back on, a new frame starts at line 0
+    if (m_Fifo.lcdOff)
+    {
+        m_Fifo = {};
+        StartFifoLine();
+    }
+
+    for (int dot = 0; dot < cycles; dot++)
+        StepFifo();
+}
+
+void Emulator::StepFifo()
+{
+    FifoState& fifo = m_Fifo;
+
+    if (fifo.mode == 3)
+        StepFifoMode3(GetMemory(0xFF44));
+
+    fifo.dot++;
+
+    // OAM scan is over, start pushing pixels
+    if ((fifo.dot == 80) && (fifo.mode == 2))
+        StartFifoMode3();
+
+    if (fifo.dot == 456)
+    {
+        if (fifo.window)
+            fifo.windowLine++;
+
+        // if gone past scanline 153 go back to 0
+        BYTE line = GetMemory(0xFF44) + 1;
+        GetWritableMemory(0xFF44) = line > 153 ? 0 : line;
+
+        fifo.dot = 0;
+        StartFifoLine();
+    }
+}
+
+void Emulator::StartFifoLine()
+{
+    FifoState& fifo = m_Fifo;
+    BYTE line = GetMemory(0xFF44);
+
+    CompareFifoLYC();
+    fifo.window = false;
+
+    if (line == 0)
+    {
+        fifo.windowLine = 0;
+        fifo.windowTriggered = false;
+    }
+
+    // we have entered vertical blank period
+    if (line >= 144)
+    {
+        if (line == 144)
+        {
+            SetFifoMode(1);
+            StartVBlank();
+        }
+        return;
+    }
+
+    // the window shows from the first line where LY matched WY
+    if (line == GetMemory(0xFF4A))
+        fifo.windowTriggered = true;
+
+    SetFifoMode(2);
+}
+
+void Emulator::StartFifoMode3()
+{
+    FifoState& fifo = m_Fifo;
+    BYTE line = GetMemory(0xFF44);
+    BYTE control = GetMemory(0xFF40);
+    int ysize = TestBit(control, 2) ? 16 : 8;
+
+    // the first 10 sprites in OAM order that cover this line.
+    // done in one go at the end of mode 2, OAM is locked during it anyway
+    fifo.lineSpriteCount = 0;
+    for (BYTE sprite = 0; (sprite < 40) && (fifo.lineSpriteCount < 10); sprite++)
+    {
+        int yPos = GetMemory(0xFE00 + sprite * 4) - 16;
+        if ((line >= yPos) && (line < yPos + ysize))
+            fifo.lineSprites[fifo.lineSpriteCount++] = sprite;
+    }
+    fifo.spritesFetched = 0;
+    fifo.spriteFetch = -1;
+
+    fifo.x = 0;
+    fifo.discard = GetMemory(0xFF43) & 7;
+    fifo.delay = 6;
+    fifo.fetchStep = 0;
+    fifo.fetchDots = 0;
+    fifo.fetchX = 0;
+    fifo.backgroundCount = 0;
+    fifo.spriteHead = 0;
+    for (FifoSprite& sprite : fifo.sprites)
+        sprite = {};
+
+    SetFifoMode(3);
+}
+
+void Emulator::StepFifoMode3(int line)
+{
+    FifoState& fifo = m_Fifo;
+
+    // the first tile gets fetched twice, the first time for nothing
+    if (fifo.delay > 0)
+    {
+        fifo.delay--;
+        return;
+    }
+
+    BYTE control = GetMemory(0xFF40);
+
+    // reaching WX throws away the background pixels and starts on the window
+    if (!fifo.window && fifo.windowTriggered && TestBit(control, 5) && TestBit(control, 0))
+    {
+        int windowX = GetMemory(0xFF4B) - 7;
+        if ((windowX < 160) && (fifo.x >= windowX))
+        {
+            fifo.window = true;
+            fifo.discard = windowX < 0 ? -windowX : 0;
+            fifo.backgroundCount = 0;
+            fifo.fetchStep = 0;
+            fifo.fetchDots = 0;
+            fifo.fetchX = 0;
+            return;
+        }
+    }
+
+    // a sprite starts at this pixel, pixels stop going out until it's fetched
+    if ((fifo.spriteFetch < 0) && TestBit(control, 1))
+    {
+        for (int i = 0; i < fifo.lineSpriteCount; i++)
+        {
+            if (TestBit(fifo.spritesFetched, i))
+                continue;
+
+            int xPos = GetMemory(0xFE00 + fifo.lineSprites[i] * 4 + 1) - 8;
+            if (xPos <= fifo.x)
+            {
+                fifo.spriteFetch = i;
+                fifo.spriteDots = 6;
+                break;
+            }
+        }
+    }
+
+    if (fifo.spriteFetch >= 0)
+    {
+        // the background fetcher has to get something into the FIFO first
+        if (fifo.backgroundCount == 0)
+        {
+            StepFifoFetcher(line);
+            return;
+        }
+
+        if (--fifo.spriteDots > 0)
+            return;
+
+        FetchFifoSprite(fifo.lineSprites[fifo.spriteFetch], line);
+        fifo.spritesFetched = BitSet(fifo.spritesFetched, fifo.spriteFetch);
+        fifo.spriteFetch = -1;
+
+        // the tile fetch it interrupted starts over
+        fifo.fetchStep = 0;
+        fifo.fetchDots = 0;
+        return;
+    }
+
+    StepFifoFetcher(line);
+
+    if (fifo.backgroundCount == 0)
+        return;
+
+    BYTE colourNum = fifo.background[fifo.backgroundHead++];
+    fifo.backgroundCount--;
+
+    // fine scroll, these never reach the screen
+    if (fifo.discard > 0)
+    {
+        fifo.discard--;
+        return;
+    }
+
+    FifoSprite& sprite = fifo.sprites[fifo.spriteHead];
+    fifo.spriteHead = (fifo.spriteHead + 1) & 7;
+
+    // the FIFO still decides how long mode 3 is, only the pixels are skipped
+    if (m_VideoMode == VideoMode::TIMING_ONLY)
+    {
+        sprite = {};
+        if (++fifo.x == 160)
+            SetFifoMode(0);
+        return;
+    }
+
+    // with the background off it's blank, sprites still show
+    if (!TestBit(control, 0))
+        colourNum = 0;
+
+    BYTE shade = m_Palettes[BGP][colourNum];
+    if ((sprite.colour != 0) && TestBit(control, 1) && !(sprite.behindBackground && colourNum != 0))
+        shade = m_Palettes[sprite.palette][sprite.colour];
+    sprite = {};
+
+    m_LineShades[fifo.x++] = shade;
+
+    // the line is out, horizontal blank for the rest of it
+    if (fifo.x == 160)
+    {
+        OutputScanLine(line);
+        SetFifoMode(0);
+    }
+}
+
+void Emulator::StepFifoFetcher(int line)
+{
+    FifoState& fifo = m_Fifo;
+    BYTE control = GetMemory(0xFF40);
+
+    // push waits until the FIFO ran dry
+    if (fifo.fetchStep == 3)
+    {
+        if (fifo.backgroundCount > 0)
+            return;
+
+        for (int pixel = 0; pixel < 8; pixel++)
+        {
+            int bit = 7 - pixel;
+            fifo.background[pixel] = (((fifo.fetchHigh >> bit) & 1) << 1) | ((fifo.fetchLow >> bit) & 1);
+        }
+        fifo.backgroundHead = 0;
+        fifo.backgroundCount = 8;
+        fifo.fetchX++;
+        fifo.fetchStep = 0;
+        return;
+    }
+
+    // the other steps take 2 dots each
+    if (++fifo.fetchDots < 2)
+        return;
+    fifo.fetchDots = 0;
+
+    // registers are read as the fetch happens, so mid line writes show up
+    int yPos = fifo.window ? fifo.windowLine : static_cast<BYTE>(line + GetMemory(0xFF42));
+
+    if (fifo.fetchStep == 0)
+    {
+        WORD map = TestBit(control, fifo.window ? 6 : 3) ? 0x9C00 : 0x9800;
+        int column = fifo.window ? fifo.fetchX : ((GetMemory(0xFF43) / 8) + fifo.fetchX) & 31;
+        fifo.fetchTile = GetMemory(map + (yPos / 8) * 32 + column);
+    }
+    else
+    {
+        // IMPORTANT: the 0x8800 area uses signed tile identifiers
+        WORD tileLocation = TestBit(control, 4)
+            ? 0x8000 + fifo.fetchTile * 16
+            : 0x9000 + static_cast<SIGNED_BYTE>(fifo.fetchTile) * 16;
+        WORD address = tileLocation + (yPos % 8) * 2;
+
+        if (fifo.fetchStep == 1)
+            fifo.fetchLow = GetMemory(address);
+        else
+            fifo.fetchHigh = GetMemory(address + 1);
+    }
+
+    fifo.fetchStep++;
+}
+
+void Emulator::FetchFifoSprite(int index, int line)
+{
+    FifoState& fifo = m_Fifo;
+    BYTE control = GetMemory(0xFF40);
+    int ysize = TestBit(control, 2) ? 16 : 8;
+
+    const BYTE* oam = GetRenderMemory(0xFE00 + index * 4);
+    int xPos = oam[1] - 8;
+    BYTE tileLocation = oam[2];
+    BYTE attributes = oam[3];
+
+    // 8x16 sprites ignore bit 0 of the tile number
+    if (ysize == 16)
+        tileLocation &= 0xFE;
+
+    int row = line - (oam[0] - 16);
+    if (TestBit(attributes, 6))
+        row = ysize - 1 - row;
+
+    WORD dataAddress = 0x8000 + tileLocation * 16 + row * 2;
+    BYTE low = GetMemory(dataAddress);
+    BYTE high = GetMemory(dataAddress + 1);
+
+    for (int xPix = 0; xPix < 8; xPix++)
+    {
+        // pixels left of the screen edge are already gone
+        int slot = xPos + xPix - fifo.x;
+        if ((slot < 0) || (slot > 7))
+            continue;
+
+        int bit = TestBit(attributes, 5) ? xPix : 7 - xPix;
+        BYTE colourNum = (((high >> bit) & 1) << 1) | ((low >> bit) & 1);
+
+        // a sprite fetched earlier keeps its pixels, unless they're transparent
+        FifoSprite& sprite = fifo.sprites[(fifo.spriteHead + slot) & 7];
+        if ((sprite.colour == 0) && (colourNum != 0))
+        {
+            sprite.colour = colourNum;
+            sprite.palette = TestBit(attributes, 4) ? OBP1 : OBP0;
+            sprite.behindBackground = TestBit(attributes, 7);
+        }
+    }
+}
+
+void Emulator::SetFifoMode(int mode)
+{
+    m_Fifo.mode = mode;
+
+    BYTE status = GetMemory(0xFF41);
+    GetWritableMemory(0xFF41) = (status & 0xFC) | mode;
+
+    // just entered a new mode so request interupt
+    bool reqInt = false;
+    switch (mode)
+    {
+    case 0: reqInt = TestBit(status, 3); break;
+    case 1: reqInt = TestBit(status, 4); break;
+    case 2: reqInt = TestBit(status, 5); break;
+    default: break;
+    }
+
+    if (reqInt)
+        RequestInterupt(1);
+}
+
+void Emulator::CompareFifoLYC()
+{
+    BYTE status = GetMemory(0xFF41);
+
+    // check the conincidence flag
+    if (GetMemory(0xFF44) == GetMemory(0xFF45))
+    {
+        status = BitSet(status, 2);
+        if (TestBit(status, 6))
+            RequestInterupt(1);
+    }
+    else
+    {
+        status = BitReset(status, 2);
+    }
+    GetWritableMemory(0xFF41) = status;
+}
@@ -1,26 +1,60 @@
 #include "Emulator.h"
 #include "Misc/BitOps.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <fstream>
 
 void Emulator::Update()
 {
-    constexpr int MAXCYCLES{ 69905 * 4 };
     int cyclesThisUpdate = 0;
 
-    while (cyclesThisUpdate < MAXCYCLES)
+    // run to the start of the next vertical blank
+    m_FrameDone = false;
+    while (!m_FrameDone && (IsLCDEnabled() || cyclesThisUpdate < FRAME_CYCLES))
     {
+        ApplyDueInput();
+
         int cycles = ExecuteNextOpcode();
         cyclesThisUpdate += cycles;
+        m_TotalCycles += cycles;
         UpdateTimers(cycles);
         UpdateGraphics(cycles);
         DoInterupts();
     }
+
+    FinishUpdate();
+}
+
+void Emulator::ApplyDueInput()
+{
+    // input that's due takes effect before the next instruction
+    while (!m_InputQueue.empty() && (m_InputQueue.front().cycle <= m_TotalCycles))
+    {
+        InputEvent input = m_InputQueue.front();
+        m_InputQueue.pop_front();
+        if (input.pressed)
+            KeyPressed(input.key);
+        else
+            KeyReleased(input.key);
+    }
+}
+
+void Emulator::FinishUpdate()
+{
+    // wait for the render thread to finish the lines drawn so far
+    if (IsRenderThreadEnabled())
+        SyncRenderThread();
+
+    // the render thread is idle now, so the lines it marked are safe to read
+    m_FrameDirtyRows = m_DirtyRows;
+    m_DirtyRows.reset();
 }
 
 void Emulator::LoadGame(std::string_view path) 
 {
-    m_CartridgeMemory = std::make_unique<BYTE[]>(0x200000);
+    m_CartridgeMemory = std::make_shared<BYTE[]>(0x200000);
     
     int i{};
     for (std::ifstream file{ path.data(), std::ios::binary }; file.good();)
@@ -36,7 +70,18 @@ void Emulator::LoadGame(std::string_view path)
     default: break;
     }
 
-    std::copy_n(m_CartridgeMemory.get(), 0x8000, m_Rom);
+    for (int page = 0; page < 0x8000 / RAM_PAGE_SIZE; page++)
+        std::copy_n(&m_CartridgeMemory[page * RAM_PAGE_SIZE], RAM_PAGE_SIZE, GetWritableMemoryPage(page).bytes);
+
+    // the last byte read is the end of file
+    m_RomHash = 0xCBF29CE484222325;
+    for (int byte = 0; byte < i - 1; byte++)
+        m_RomHash = (m_RomHash ^ m_CartridgeMemory[byte]) * 0x100000001B3;
+
+    // so resetting never has to read the file again
+    auto loaded = std::make_shared<Snapshot>();
+    TakeSnapshot(*loaded);
+    m_LoadedSnapshot = std::move(loaded);
 
     gameLoadStatus = 1;
 }
@@ -48,37 +93,141 @@ Emulator::Emulator() {
     m_RegisterDE.reg = 0x00D8;
     m_RegisterHL.reg = 0x014D;
     m_StackPointer.reg = 0xFFFE;
-    m_Rom[0xFF05] = 0x00;
-    m_Rom[0xFF06] = 0x00;
-    m_Rom[0xFF07] = 0x00;
-    m_Rom[0xFF10] = 0x80;
-    m_Rom[0xFF11] = 0xBF;
-    m_Rom[0xFF12] = 0xF3;
-    m_Rom[0xFF14] = 0xBF;
-    m_Rom[0xFF16] = 0x3F;
-    m_Rom[0xFF17] = 0x00;
-    m_Rom[0xFF19] = 0xBF;
-    m_Rom[0xFF1A] = 0x7F;
-    m_Rom[0xFF1B] = 0xFF;
-    m_Rom[0xFF1C] = 0x9F;
-    m_Rom[0xFF1E] = 0xBF;
-    m_Rom[0xFF20] = 0xFF;
-    m_Rom[0xFF21] = 0x00;
-    m_Rom[0xFF22] = 0x00;
-    m_Rom[0xFF23] = 0xBF;
-    m_Rom[0xFF24] = 0x77;
-    m_Rom[0xFF25] = 0xF3;
-    m_Rom[0xFF26] = 0xF1;
-    m_Rom[0xFF40] = 0x91;
-    m_Rom[0xFF42] = 0x00;
-    m_Rom[0xFF43] = 0x00;
-    m_Rom[0xFF45] = 0x00;
-    m_Rom[0xFF47] = 0xFC;
-    m_Rom[0xFF48] = 0xFF;
-    m_Rom[0xFF49] = 0xFF;
-    m_Rom[0xFF4A] = 0x00;
-    m_Rom[0xFF4B] = 0x00;
-    m_Rom[0xFFFF] = 0x00;
+
+    // nothing written to memory or cartridge RAM yet, every page reads as zeros
+    static const std::shared_ptr<RamPage> zeros{ std::make_shared<RamPage>() };
+    m_MemoryPages.fill(zeros);
+    m_RAMPages.fill(zeros);
+
+    GetWritableMemory(0xFF05) = 0x00;
+    GetWritableMemory(0xFF06) = 0x00;
+    GetWritableMemory(0xFF07) = 0x00;
+    GetWritableMemory(0xFF10) = 0x80;
+    GetWritableMemory(0xFF11) = 0xBF;
+    GetWritableMemory(0xFF12) = 0xF3;
+    GetWritableMemory(0xFF14) = 0xBF;
+    GetWritableMemory(0xFF16) = 0x3F;
+    GetWritableMemory(0xFF17) = 0x00;
+    GetWritableMemory(0xFF19) = 0xBF;
+    GetWritableMemory(0xFF1A) = 0x7F;
+    GetWritableMemory(0xFF1B) = 0xFF;
+    GetWritableMemory(0xFF1C) = 0x9F;
+    GetWritableMemory(0xFF1E) = 0xBF;
+    GetWritableMemory(0xFF20) = 0xFF;
+    GetWritableMemory(0xFF21) = 0x00;
+    GetWritableMemory(0xFF22) = 0x00;
+    GetWritableMemory(0xFF23) = 0xBF;
+    GetWritableMemory(0xFF24) = 0x77;
+    GetWritableMemory(0xFF25) = 0xF3;
+    GetWritableMemory(0xFF26) = 0xF1;
+    GetWritableMemory(0xFF40) = 0x91;
+    GetWritableMemory(0xFF42) = 0x00;
+    GetWritableMemory(0xFF43) = 0x00;
+    GetWritableMemory(0xFF45) = 0x00;
+    GetWritableMemory(0xFF47) = 0xFC;
+    GetWritableMemory(0xFF48) = 0xFF;
+    GetWritableMemory(0xFF49) = 0xFF;
+    GetWritableMemory(0xFF4A) = 0x00;
+    GetWritableMemory(0xFF4B) = 0x00;
+    GetWritableMemory(0xFFFF) = 0x00;
+
+    for (WORD address = 0xFF47; address <= 0xFF49; address++)
+        UpdatePalette(address);
+
+    SetFrameBuffer(nullptr, 0, PixelFormat::RGBA8888);
+}
+
+Emulator::~Emulator()
+{
+    SetRenderThread(false);
+}
+
+void Emulator::SetVideoMode(VideoMode mode)
+{
+    m_PendingVideoMode = mode;
+
+    // no line is drawn before the next frame anyway
+    if (!IsLCDEnabled() || (GetMemory(0xFF44) >= 144))
+        m_VideoMode = mode;
+}
+
+VideoMode Emulator::GetVideoMode() const
+{
+    return m_VideoMode;
+}
+
+const std::bitset<144>& Emulator::GetDirtyRows() const
+{
+    return m_FrameDirtyRows;
+}
+
+void Emulator::SetFrameBuffer(void* pixels, int pitch, PixelFormat format)
+{
+    // the internal frame may not be there yet, it is once a line is drawn
+    if (pixels == nullptr)
+    {
+        pixels = m_OwnedFrame.get();
+        pitch = GetRowBytes(PixelFormat::RGBA8888);
+        format = PixelFormat::RGBA8888;
+    }
+
+    assert(pitch >= GetRowBytes(format));
+
+    m_FrameBuffer = static_cast<BYTE*>(pixels);
+    m_FramePitch = pitch;
+    m_PixelFormat = format;
+
+    // what gets stored for each shade, so writing out a line is one lookup per pixel
+    for (int shade = 0; shade < 4; shade++)
+    {
+        BYTE grey = SHADE_VALUES[shade];
+        switch (format)
+        {
+        case PixelFormat::RGBA8888:
+        {
+            BYTE rgba[4]{ grey, grey, grey, 0xFF };
+            std::memcpy(&m_FormatColours[shade], rgba, 4);
+        }
+        break;
+
+        case PixelFormat::RGB565:
+            m_FormatColours[shade] = ((grey >> 3) << 11) | ((grey >> 2) << 5) | (grey >> 3);
+            break;
+
+        default:
+            m_FormatColours[shade] = shade;
+            break;
+        }
+    }
+}
+
+const BYTE* Emulator::GetFrameBuffer() const
+{
+    // nothing drawn into the internal frame yet, it would be all zeros
+    static const std::unique_ptr<BYTE[]> blank{ std::make_unique<BYTE[]>(144 * GetRowBytes(PixelFormat::RGBA8888)) };
+    return m_FrameBuffer ? m_FrameBuffer : blank.get();
+}
+
+int Emulator::GetFramePitch() const
+{
+    return m_FramePitch;
+}
+
+PixelFormat Emulator::GetPixelFormat() const
+{
+    return m_PixelFormat;
+}
+
+int Emulator::GetRowBytes(PixelFormat format)
+{
+    switch (format)
+    {
+    case PixelFormat::RGBA8888: return 160 * 4;
+    case PixelFormat::RGB565: return 160 * 2;
+    case PixelFormat::SHADE8: return 160;
+    case PixelFormat::PACKED2BPP: return 160 / 4;
+    }
+    return 0;
 }
 
 // I'm too lazy to refactor this
@@ -102,7 +251,7 @@ void Emulator::KeyPressed(int key)
     else // directional button pressed
         button = false;
 
-    BYTE keyReq = m_Rom[0xFF00];
+    BYTE keyReq = GetMemory(0xFF00);
     bool requestInterupt = false;
 
     // only request interupt if the button just pressed is
@@ -122,4 +271,46 @@ void Emulator::KeyPressed(int key)
 void Emulator::KeyReleased(int key)
 {
     m_JoypadState = BitSet(m_JoypadState, key);
+}
+
+void Emulator::QueueInput(uint64_t cycle, int key, bool pressed)
+{
+    // nearly always goes on the end, after anything stamped the same
+    auto later = std::upper_bound(m_InputQueue.begin(), m_InputQueue.end(), cycle,
+        [](uint64_t cycle, const InputEvent& input) { return cycle < input.cycle; });
+    m_InputQueue.insert(later, { cycle, key, pressed });
+}
+
+uint8_t Emulator::GetHeldButtons() const
+{
+    // pressed keys are the 0 bits, the queue has the last word on them
+    uint8_t held = static_cast<uint8_t>(~m_JoypadState);
+    for (const InputEvent& input : m_InputQueue)
+    {
+        if (input.pressed)
+            held |= 1 << input.key;
+        else
+            held &= ~(1 << input.key);
+    }
+    return held;
+}
+
+void Emulator::SetHeldButtons(uint8_t mask)
+{
+    uint8_t changed = mask ^ GetHeldButtons();
+    for (int key = 0; key < 8; key++)
+    {
+        if (changed & (1 << key))
+            QueueInput(m_TotalCycles, key, (mask >> key) & 1);
+    }
+}
+
+uint64_t Emulator::GetCycleCount() const
+{
+    return m_TotalCycles;
+}
+
+BYTE Emulator::PeekMemory(WORD address) const
+{
+    return ReadMemory(address);
 }
\ No newline at end of file
@@ -0,0 +1,110 @@
+#include "Emulator.h"
+
+#include <algorithm>
+
+void Emulator::SetRenderThread(bool enabled)
+{
+    if (enabled == IsRenderThreadEnabled())
+        return;
+
+    // only the scanline backend can render from the log
+    if (enabled && (m_PpuBackend == PpuBackend::FIFO))
+        return;
+
+    if (enabled)
+    {
+        // the render thread starts from a copy of what the CPU sees now,
+        // the caches were built from that same memory so they stay valid
+        auto shadow = std::make_unique<BYTE[]>(0x10000);
+        for (size_t page = 0; page < m_MemoryPages.size(); page++)
+            std::copy_n(m_MemoryPages[page]->bytes, RAM_PAGE_SIZE, &shadow[page * RAM_PAGE_SIZE]);
+        m_RenderShadow = std::move(shadow);
+
+        m_VideoLog = std::make_unique<SpscQueue<VideoEvent, 1 << 16>>();
+        m_RenderThread = std::thread(&Emulator::RenderThreadLoop, this);
+    }
+    else
+    {
+        // let it work through everything logged so far, then stop it
+        PushVideoEvent(VIDEO_STOP, 0, 0);
+        m_RenderThread.join();
+
+        m_VideoLog.reset();
+        m_RenderShadow.reset();
+    }
+}
+
+bool Emulator::IsRenderThreadEnabled() const
+{
+    return m_VideoLog != nullptr;
+}
+
+void Emulator::PushVideoEvent(BYTE kind, WORD address, BYTE data)
+{
+    VideoEvent event{ address, data, kind };
+
+    // the log only fills up if the render thread is a long way behind,
+    // make sure it's awake and give it the time to catch up
+    while (!m_VideoLog->TryPush(event))
+    {
+        m_VideoSignal.fetch_add(1, std::memory_order_release);
+        m_VideoSignal.notify_one();
+        std::this_thread::yield();
+    }
+
+    // plain writes are picked up with the next line, no need to wake it for them
+    if (kind != VIDEO_WRITE)
+    {
+        m_VideoSignal.fetch_add(1, std::memory_order_release);
+        m_VideoSignal.notify_one();
+    }
+}
+
+void Emulator::SyncRenderThread()
+{
+    uint32_t sync = ++m_VideoSyncs;
+    PushVideoEvent(VIDEO_SYNC, 0, 0);
+
+    uint32_t synced = m_VideoSynced.load(std::memory_order_acquire);
+    while (synced != sync)
+    {
+        m_VideoSynced.wait(synced, std::memory_order_acquire);
+        synced = m_VideoSynced.load(std::memory_order_acquire);
+    }
+}
+
+void Emulator::RenderThreadLoop()
+{
+    while (true)
+    {
+        // read the signal before looking at the log, so a line queued
+        // in between makes the wait below return straight away
+        uint32_t signal = m_VideoSignal.load(std::memory_order_acquire);
+
+        VideoEvent event;
+        if (!m_VideoLog->TryPop(event))
+        {
+            m_VideoSignal.wait(signal, std::memory_order_acquire);
+            continue;
+        }
+
+        switch (event.kind)
+        {
+        case VIDEO_WRITE:
+            ApplyVideoWrite(event.address, event.data);
+            break;
+
+        case VIDEO_LINE:
+            RenderScanLine(event.address);
+            break;
+
+        case VIDEO_SYNC:
+            m_VideoSynced.fetch_add(1, std::memory_order_release);
+            m_VideoSynced.notify_one();
+            break;
+
+        case VIDEO_STOP:
+            return;
+        }
+    }
+}
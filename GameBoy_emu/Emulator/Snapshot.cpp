@@ -0,0 +1,331 @@
+#include "Emulator.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+void Emulator::TakeSnapshot(Snapshot& snapshot) const
+{
+    Snapshot::State& state = snapshot.state;
+    for (size_t page = 0; page < m_MemoryPages.size(); page++)
+        std::copy_n(m_MemoryPages[page]->bytes, RAM_PAGE_SIZE, state.memory + page * RAM_PAGE_SIZE);
+    for (size_t page = 0; page < m_RAMPages.size(); page++)
+        std::copy_n(m_RAMPages[page]->bytes, RAM_PAGE_SIZE, state.ramBanks + page * RAM_PAGE_SIZE);
+
+    state.af = m_RegisterAF.reg;
+    state.bc = m_RegisterBC.reg;
+    state.de = m_RegisterDE.reg;
+    state.hl = m_RegisterHL.reg;
+    state.pc = m_ProgramCounter;
+    state.sp = m_StackPointer.reg;
+
+    state.currentROMBank = m_CurrentROMBank;
+    state.currentRAMBank = m_CurrentRAMBank;
+    state.mbc1 = m_MBC1;
+    state.mbc2 = m_MBC2;
+    state.enableRAM = m_EnableRAM;
+    state.romBanking = m_RomBanking;
+
+    state.timerCounter = m_TimerCounter;
+    state.dividerCounter = m_DividerCounter;
+    state.interuptMaster = m_InteruptMaster;
+    state.pendingInteruptDisabled = m_PendingInteruptDisabled;
+    state.pendingInteruptEnabled = m_PendingInteruptEnabled;
+    state.halted = m_Halted;
+
+    state.scanlineCounter = m_ScanlineCounter;
+    state.fifo = m_Fifo;
+
+    state.joypadState = m_JoypadState;
+    state.totalCycles = m_TotalCycles;
+    snapshot.inputs.assign(m_InputQueue.begin(), m_InputQueue.end());
+}
+
+std::unique_ptr<Emulator> Emulator::Fork()
+{
+    auto child = std::make_unique<Emulator>();
+    child->gameLoadStatus = gameLoadStatus;
+    child->m_CartridgeMemory = m_CartridgeMemory;
+    child->m_RomHash = m_RomHash;
+    child->m_LoadedSnapshot = m_LoadedSnapshot;
+
+    // from here on both have to copy a page before writing to it
+    child->m_MemoryPages = m_MemoryPages;
+    child->m_RAMPages = m_RAMPages;
+    child->m_OwnedMemoryPages = 0;
+    m_OwnedMemoryPages = 0;
+    m_OwnedRAMPages = 0;
+
+    child->SetFrameBuffer(nullptr, 0, m_PixelFormat);
+    child->SetPpuBackend(m_PpuBackend);
+    child->m_VideoMode = m_VideoMode;
+    child->m_PendingVideoMode = m_PendingVideoMode;
+
+    // the rest of what a snapshot holds goes straight across
+    child->m_RegisterAF = m_RegisterAF;
+    child->m_RegisterBC = m_RegisterBC;
+    child->m_RegisterDE = m_RegisterDE;
+    child->m_RegisterHL = m_RegisterHL;
+    child->m_ProgramCounter = m_ProgramCounter;
+    child->m_StackPointer = m_StackPointer;
+
+    child->m_CurrentROMBank = m_CurrentROMBank;
+    child->m_CurrentRAMBank = m_CurrentRAMBank;
+    child->m_MBC1 = m_MBC1;
+    child->m_MBC2 = m_MBC2;
+    child->m_EnableRAM = m_EnableRAM;
+    child->m_RomBanking = m_RomBanking;
+
+    child->m_TimerCounter = m_TimerCounter;
+    child->m_DividerCounter = m_DividerCounter;
+    child->m_InteruptMaster = m_InteruptMaster;
+    child->m_PendingInteruptDisabled = m_PendingInteruptDisabled;
+    child->m_PendingInteruptEnabled = m_PendingInteruptEnabled;
+    child->m_Halted = m_Halted;
+
+    child->m_ScanlineCounter = m_ScanlineCounter;
+    child->m_Fifo = m_Fifo;
+
+    child->m_JoypadState = m_JoypadState;
+    child->m_TotalCycles = m_TotalCycles;
+    child->m_InputQueue = m_InputQueue;
+
+    // the child's caches start out empty, only the palettes are worked out up front
+    for (WORD address = 0xFF47; address <= 0xFF49; address++)
+        child->UpdatePalette(address);
+    return child;
+}
+
+void Emulator::RestoreSnapshot(const Snapshot& snapshot)
+{
+    // the render thread has to be done with the old memory before it changes
+    if (IsRenderThreadEnabled())
+        SyncRenderThread();
+
+    // pages that already hold the right bytes stay shared
+    const Snapshot::State& state = snapshot.state;
+    for (size_t page = 0; page < m_MemoryPages.size(); page++)
+    {
+        const BYTE* bytes = state.memory + page * RAM_PAGE_SIZE;
+        if (!std::equal(bytes, bytes + RAM_PAGE_SIZE, m_MemoryPages[page]->bytes))
+            std::copy_n(bytes, RAM_PAGE_SIZE, GetWritableMemoryPage(page).bytes);
+    }
+    for (size_t page = 0; page < m_RAMPages.size(); page++)
+    {
+        const BYTE* bytes = state.ramBanks + page * RAM_PAGE_SIZE;
+        if (!std::equal(bytes, bytes + RAM_PAGE_SIZE, m_RAMPages[page]->bytes))
+            std::copy_n(bytes, RAM_PAGE_SIZE, GetWritableRamPage(page).bytes);
+    }
+    if (m_RenderShadow)
+        std::copy_n(state.memory, 0x10000, m_RenderShadow.get());
+
+    m_RegisterAF.reg = state.af;
+    m_RegisterBC.reg = state.bc;
+    m_RegisterDE.reg = state.de;
+    m_RegisterHL.reg = state.hl;
+    m_ProgramCounter = state.pc;
+    m_StackPointer.reg = state.sp;
+
+    m_CurrentROMBank = state.currentROMBank;
+    m_CurrentRAMBank = state.currentRAMBank;
+    m_MBC1 = state.mbc1;
+    m_MBC2 = state.mbc2;
+    m_EnableRAM = state.enableRAM;
+    m_RomBanking = state.romBanking;
+
+    m_TimerCounter = state.timerCounter;
+    m_DividerCounter = state.dividerCounter;
+    m_InteruptMaster = state.interuptMaster;
+    m_PendingInteruptDisabled = state.pendingInteruptDisabled;
+    m_PendingInteruptEnabled = state.pendingInteruptEnabled;
+    m_Halted = state.halted;
+
+    m_ScanlineCounter = state.scanlineCounter;
+    m_Fifo = state.fifo;
+
+    m_JoypadState = state.joypadState;
+    m_TotalCycles = state.totalCycles;
+    m_InputQueue.assign(snapshot.inputs.begin(), snapshot.inputs.end());
+
+    // everything worked out from VRAM, OAM and the palettes is stale now
+    for (uint32_t& version : m_TileVersions)
+        version++;
+    m_VramGeneration++;
+    m_SpritesDirty = true;
+    for (WORD address = 0xFF47; address <= 0xFF49; address++)
+        UpdatePalette(address);
+}
+
+void Emulator::Reset()
+{
+    if (m_LoadedSnapshot)
+        ResetTo(*m_LoadedSnapshot);
+}
+
+void Emulator::ResetTo(const Snapshot& snapshot)
+{
+    RestoreSnapshot(snapshot);
+
+    // as if nothing had been drawn yet, every line of the next frame counts as
+    // changed. The buffer is kept, a reset allocates nothing
+    if (m_LastShades)
+        std::fill_n(m_LastShades.get(), 144 * 160, 0xFF);
+    m_DirtyRows.reset();
+    m_FrameDirtyRows.reset();
+}
+
+namespace
+{
+    // bump whenever Snapshot::State changes
+    constexpr uint32_t SAVE_STATE_VERSION = 1;
+    constexpr char SAVE_STATE_MAGIC[4]{ 'G', 'B', 'S', 'S' };
+
+    struct SaveStateHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t romHash;
+        // the layout depends on the compiler too, a different size won't load
+        uint32_t stateSize;
+        uint32_t inputCount;
+    };
+}
+
+void Emulator::SaveState(const Snapshot& snapshot, std::vector<BYTE>& data) const
+{
+    static_assert(std::is_trivially_copyable_v<Snapshot::State>);
+    static_assert(std::is_trivially_copyable_v<InputEvent>);
+
+    SaveStateHeader header{};
+    std::memcpy(header.magic, SAVE_STATE_MAGIC, sizeof(header.magic));
+    header.version = SAVE_STATE_VERSION;
+    header.romHash = m_RomHash;
+    header.stateSize = sizeof(Snapshot::State);
+    header.inputCount = static_cast<uint32_t>(snapshot.inputs.size());
+
+    // the header, the state, then whatever input is still queued
+    size_t inputBytes = snapshot.inputs.size() * sizeof(InputEvent);
+    data.resize(sizeof(header) + sizeof(Snapshot::State) + inputBytes);
+
+    BYTE* out = data.data();
+    std::memcpy(out, &header, sizeof(header));
+    std::memcpy(out + sizeof(header), &snapshot.state, sizeof(Snapshot::State));
+    if (inputBytes > 0)
+        std::memcpy(out + sizeof(header) + sizeof(Snapshot::State), snapshot.inputs.data(), inputBytes);
+}
+
+bool Emulator::LoadState(const BYTE* data, size_t size, Snapshot& snapshot) const
+{
+    SaveStateHeader header;
+    if (size < sizeof(header))
+        return false;
+    std::memcpy(&header, data, sizeof(header));
+
+    if ((std::memcmp(header.magic, SAVE_STATE_MAGIC, sizeof(header.magic)) != 0) ||
+        (header.version != SAVE_STATE_VERSION) ||
+        (header.stateSize != sizeof(Snapshot::State)) ||
+        (header.romHash != m_RomHash))
+        return false;
+
+    size_t inputBytes = size_t(header.inputCount) * sizeof(InputEvent);
+    if (size != sizeof(header) + sizeof(Snapshot::State) + inputBytes)
+        return false;
+
+    // nothing is copied unless all of it checks out
+    const BYTE* state = data + sizeof(header);
+    if (!IsValidState(state, state + sizeof(Snapshot::State), header.inputCount))
+        return false;
+
+    std::memcpy(&snapshot.state, state, sizeof(Snapshot::State));
+    snapshot.inputs.resize(header.inputCount);
+    if (inputBytes > 0)
+        std::memcpy(snapshot.inputs.data(), data + sizeof(header) + sizeof(Snapshot::State), inputBytes);
+    return true;
+}
+
+bool Emulator::IsValidState(const BYTE* state, const BYTE* inputs, uint32_t inputCount)
+{
+    // bools that aren't 0 or 1 are undefined, so they're checked as bytes
+    constexpr size_t FIFO{ offsetof(Snapshot::State, fifo) };
+    constexpr size_t BOOLS[]{
+        offsetof(Snapshot::State, mbc1), offsetof(Snapshot::State, mbc2),
+        offsetof(Snapshot::State, enableRAM), offsetof(Snapshot::State, romBanking),
+        offsetof(Snapshot::State, interuptMaster), offsetof(Snapshot::State, pendingInteruptDisabled),
+        offsetof(Snapshot::State, pendingInteruptEnabled), offsetof(Snapshot::State, halted),
+        FIFO + offsetof(FifoState, lcdOff), FIFO + offsetof(FifoState, window),
+        FIFO + offsetof(FifoState, windowTriggered),
+    };
+    for (size_t offset : BOOLS)
+    {
+        if (state[offset] > 1)
+            return false;
+    }
+    for (int slot = 0; slot < 8; slot++)
+    {
+        if (state[FIFO + offsetof(FifoState, sprites) + slot * sizeof(FifoSprite) + offsetof(FifoSprite, behindBackground)] > 1)
+            return false;
+    }
+
+    // the banks and the FIFO positions index arrays
+    int romBank;
+    BYTE ramBank;
+    FifoState fifo;
+    std::memcpy(&romBank, state + offsetof(Snapshot::State, currentROMBank), sizeof(romBank));
+    std::memcpy(&ramBank, state + offsetof(Snapshot::State, currentRAMBank), sizeof(ramBank));
+    std::memcpy(&fifo, state + FIFO, sizeof(fifo));
+
+    if ((romBank < 0) || (romBank >= 0x200000 / 0x4000) || (ramBank > 3))
+        return false;
+    if ((fifo.dot < 0) || (fifo.dot > 455) || (fifo.mode < 0) || (fifo.mode > 3) || (fifo.x < 0) || (fifo.x > 160) ||
+        (fifo.backgroundHead < 0) || (fifo.backgroundCount < 0) || (fifo.backgroundHead + fifo.backgroundCount > 8) ||
+        (fifo.spriteHead < 0) || (fifo.spriteHead > 7) || (fifo.lineSpriteCount < 0) || (fifo.lineSpriteCount > 10) ||
+        (fifo.spriteFetch < -1) || (fifo.spriteFetch > 9))
+        return false;
+    for (int i = 0; i < fifo.lineSpriteCount; i++)
+    {
+        if (fifo.lineSprites[i] >= 40)
+            return false;
+    }
+
+    for (uint32_t i = 0; i < inputCount; i++)
+    {
+        const BYTE* event = inputs + i * sizeof(InputEvent);
+        int key;
+        std::memcpy(&key, event + offsetof(InputEvent, key), sizeof(key));
+        if ((key < 0) || (key > 7) || (event[offsetof(InputEvent, pressed)] > 1))
+            return false;
+    }
+    return true;
+}
+
+uint64_t Emulator::GetRomHash() const
+{
+    return m_RomHash;
+}
+
+uint64_t Emulator::GetStateHash() const
+{
+    // FNV-1a, 8 bytes at a time
+    uint64_t hash = 0xCBF29CE484222325;
+    auto add = [&hash](const void* data, size_t size) {
+        const BYTE* bytes = static_cast<const BYTE*>(data);
+        for (size_t pos = 0; pos < size; pos += 8)
+        {
+            uint64_t word = 0;
+            std::memcpy(&word, bytes + pos, std::min<size_t>(8, size - pos));
+            hash = (hash ^ word) * 0x100000001B3;
+        }
+    };
+
+    for (const std::shared_ptr<RamPage>& page : m_MemoryPages)
+        add(page->bytes, RAM_PAGE_SIZE);
+    for (const std::shared_ptr<RamPage>& page : m_RAMPages)
+        add(page->bytes, RAM_PAGE_SIZE);
+
+    const WORD registers[]{ m_RegisterAF.reg, m_RegisterBC.reg, m_RegisterDE.reg,
+        m_RegisterHL.reg, m_ProgramCounter, m_StackPointer.reg };
+    add(registers, sizeof(registers));
+    add(&m_TotalCycles, sizeof(m_TotalCycles));
+    return hash;
+}
@@ -58,6 +58,6 @@ void Emulator::DoDividerRegister(int cycles)
     if (m_DividerCounter >= 255)
     {
         m_DividerCounter = 0;
-        m_Rom[0xFF04]++;
+        GetWritableMemory(0xFF04)++;
     }
 }
\ No newline at end of file
@@ -0,0 +1,513 @@
+// Runs a game with no window, no SDL and no frame pacing, as fast as the host
+// allows. For servers, batch jobs and benchmarks
+#include "Emulator/Emulator.h"
+#include "Emulator/Misc/BatchRunner.h"
+#include "Emulator/Misc/LockstepRunner.h"
+#include "Emulator/Misc/Movie.h"
+#include "Emulator/Misc/RewindBuffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+	struct Options
+	{
+		std::string rom{};
+		int frames{};	// 600, or all of the movie being played
+		std::string inputScript{};
+		std::set<int> dumpFrames{};
+		std::string stateIn{};
+		std::string stateOut{};
+		int stateBench{};
+		bool rewindStats{};
+		std::string record{};
+		std::string play{};
+		int batch{};	// instances, 0 = just the one
+		int threads{};	// 0 = one per core
+		bool pin{};
+		bool lockstep{};	// run --batch instances through the lockstep core
+	};
+
+	// one line of an input script: "<frame> <button> press|release"
+	struct ScriptedInput
+	{
+		int key;
+		bool pressed;
+	};
+
+	void PrintUsage()
+	{
+		std::cerr << "Usage: GameBoy_headless --rom <path> [--frames N] [--input-script <path>]\n"
+			"                        [--dump-frame N]... [--state-in <path>] [--state-out <path>]\n"
+			"                        [--bench-state N] [--rewind-stats] [--record <path>] [--play <path>]\n"
+			"                        [--batch N [--threads N] [--pin] [--lockstep]]\n"
+			"\n"
+			"  --frames N            frames to run, default 600 or the whole movie\n"
+			"  --input-script path   lines of \"<frame> <button> press|release\", buttons are\n"
+			"                        right left up down a b select start, # starts a comment\n"
+			"  --dump-frame N        write frame N (1 = the first) to frame_N.ppm, can repeat\n"
+			"  --state-in path       start from a saved state\n"
+			"  --state-out path      save the state after the last frame\n"
+			"  --bench-state N       time N rounds of saving and loading the state at the end\n"
+			"  --rewind-stats        keep rewind history of every frame and report what it costs\n"
+			"  --record path         save the input of this run as a movie\n"
+			"  --play path           play a movie back, checking every frame against it\n"
+			"  --batch N             run N instances at once, all with the same input script\n"
+			"  --threads N           threads for --batch, default one per core\n"
+			"  --pin                 keep each --batch thread on a core of its own\n"
+			"  --lockstep            run --batch instances in lockstep on this thread, common\n"
+			"                        instructions together in AVX2 registers (experimental,\n"
+			"                        slower than --threads 1 so far)\n";
+	}
+
+	bool ParseOptions(int argc, char* argv[], Options& options)
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			std::string_view arg{ argv[i] };
+			bool hasValue = i + 1 < argc;
+
+			if (arg == "--rom" && hasValue)
+				options.rom = argv[++i];
+			else if (arg == "--frames" && hasValue)
+				options.frames = std::atoi(argv[++i]);
+			else if (arg == "--input-script" && hasValue)
+				options.inputScript = argv[++i];
+			else if (arg == "--dump-frame" && hasValue)
+				options.dumpFrames.insert(std::atoi(argv[++i]));
+			else if (arg == "--state-in" && hasValue)
+				options.stateIn = argv[++i];
+			else if (arg == "--state-out" && hasValue)
+				options.stateOut = argv[++i];
+			else if (arg == "--bench-state" && hasValue)
+				options.stateBench = std::atoi(argv[++i]);
+			else if (arg == "--rewind-stats")
+				options.rewindStats = true;
+			else if (arg == "--record" && hasValue)
+				options.record = argv[++i];
+			else if (arg == "--play" && hasValue)
+				options.play = argv[++i];
+			else if (arg == "--batch" && hasValue)
+				options.batch = std::atoi(argv[++i]);
+			else if (arg == "--threads" && hasValue)
+				options.threads = std::atoi(argv[++i]);
+			else if (arg == "--pin")
+				options.pin = true;
+			else if (arg == "--lockstep")
+				options.lockstep = true;
+			else
+			{
+				std::cerr << "Unknown or incomplete option: " << arg << "\n";
+				return false;
+			}
+		}
+
+		if (options.rom.empty())
+		{
+			std::cerr << "--rom is required\n";
+			return false;
+		}
+		if (!options.play.empty() && !options.inputScript.empty())
+		{
+			std::cerr << "a movie brings its own input, --play doesn't go with --input-script\n";
+			return false;
+		}
+		if (!options.play.empty() && !options.record.empty())
+		{
+			std::cerr << "--play checks against the movie --record would be writing, use one or the other\n";
+			return false;
+		}
+		if ((options.batch > 0) && (!options.stateIn.empty() || !options.stateOut.empty() || !options.dumpFrames.empty() ||
+			(options.stateBench > 0) || options.rewindStats || !options.record.empty() || !options.play.empty()))
+		{
+			std::cerr << "--batch only goes with --frames, --input-script, --threads, --pin and --lockstep\n";
+			return false;
+		}
+		return true;
+	}
+
+	// same key numbers as Emulator::KeyPressed
+	bool LoadInputScript(const std::string& path, std::multimap<int, ScriptedInput>& inputs)
+	{
+		static const std::map<std::string, int> KEYS{
+			{ "right", 0 }, { "left", 1 }, { "up", 2 }, { "down", 3 },
+			{ "a", 4 }, { "b", 5 }, { "select", 6 }, { "start", 7 },
+		};
+
+		std::ifstream file{ path };
+		if (!file)
+		{
+			std::cerr << "Can't open input script " << path << "\n";
+			return false;
+		}
+
+		std::string line;
+		for (int lineNumber = 1; std::getline(file, line); lineNumber++)
+		{
+			line = line.substr(0, line.find('#'));
+			std::istringstream fields{ line };
+
+			int frame;
+			std::string button, action;
+			if (!(fields >> frame))
+				continue;
+
+			fields >> button >> action;
+			auto key = KEYS.find(button);
+			if (key == KEYS.end() || (action != "press" && action != "release"))
+			{
+				std::cerr << path << ":" << lineNumber << ": expected <frame> <button> press|release\n";
+				return false;
+			}
+			inputs.insert({ frame, { key->second, action == "press" } });
+		}
+		return true;
+	}
+
+	bool ReadFile(const std::string& path, std::vector<BYTE>& data)
+	{
+		std::ifstream file{ path, std::ios::binary };
+		if (!file)
+			return false;
+		data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		return true;
+	}
+
+	bool WriteFile(const std::string& path, const std::vector<BYTE>& data)
+	{
+		std::ofstream file{ path, std::ios::binary };
+		return bool(file.write(reinterpret_cast<const char*>(data.data()), data.size()));
+	}
+
+	bool WritePpm(const std::string& path, const Emulator& emu)
+	{
+		std::ofstream file{ path, std::ios::binary };
+		if (!file)
+			return false;
+
+		// the default frame buffer is RGBA8888, PPM wants RGB
+		file << "P6 160 144 255\n";
+		for (int y = 0; y < 144; y++)
+		{
+			const BYTE* row = emu.GetFrameBuffer() + y * emu.GetFramePitch();
+			for (int x = 0; x < 160; x++)
+				file.write(reinterpret_cast<const char*>(row + x * 4), 3);
+		}
+		return file.good();
+	}
+
+	// capture and restore are what run-ahead and rewind pay every frame,
+	// saving and loading only on the way to and from disk
+	void BenchState(Emulator& emu, int rounds)
+	{
+		using Clock = std::chrono::steady_clock;
+		auto snapshot = std::make_unique<Emulator::Snapshot>();
+		auto loaded = std::make_unique<Emulator::Snapshot>();
+		std::vector<BYTE> data;
+		Clock::duration take{}, save{}, load{}, restore{};
+
+		for (int round = 0; round < rounds; round++)
+		{
+			auto start = Clock::now();
+			emu.TakeSnapshot(*snapshot);
+			auto taken = Clock::now();
+			emu.SaveState(*snapshot, data);
+			auto saved = Clock::now();
+			emu.LoadState(data.data(), data.size(), *loaded);
+			auto loadedAt = Clock::now();
+			emu.RestoreSnapshot(*loaded);
+			auto restored = Clock::now();
+
+			take += taken - start;
+			save += saved - taken;
+			load += loadedAt - saved;
+			restore += restored - loadedAt;
+		}
+
+		auto average = [rounds](Clock::duration total) {
+			return std::chrono::duration<double, std::micro>(total).count() / rounds;
+		};
+		std::cout << "state:      " << data.size() << " bytes, per round over " << rounds << " rounds:\n"
+			<< "  take:     " << average(take) << " us\n"
+			<< "  save:     " << average(save) << " us\n"
+			<< "  load:     " << average(load) << " us\n"
+			<< "  restore:  " << average(restore) << " us\n";
+	}
+
+	// many instances stepped a frame at a time, what's measured is the whole pool
+	int RunBatch(Options options, const std::multimap<int, ScriptedInput>& inputs)
+	{
+		if (options.frames == 0)
+			options.frames = 600;
+
+		BatchRunner batch{ options.rom, options.batch, options.threads, options.pin };
+		for (int i = 0; i < batch.GetInstanceCount(); i++)
+			batch.GetInstance(i).SetVideoMode(VideoMode::TIMING_ONLY);
+
+		std::vector<uint8_t> buttons(batch.GetInstanceCount());
+		uint8_t held = 0;
+		auto start = std::chrono::steady_clock::now();
+
+		for (int frame = 1; frame <= options.frames; frame++)
+		{
+			auto [first, last] = inputs.equal_range(frame);
+			for (auto input = first; input != last; ++input)
+			{
+				if (input->second.pressed)
+					held |= 1 << input->second.key;
+				else
+					held &= ~(1 << input->second.key);
+			}
+			std::fill(buttons.begin(), buttons.end(), held);
+			batch.Step(buttons.data());
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double frames = double(options.frames) * batch.GetInstanceCount();
+		std::cout << std::fixed << std::setprecision(2)
+			<< "instances:  " << batch.GetInstanceCount() << " on " << batch.GetThreadCount() << " threads\n"
+			<< "frames:     " << options.frames << " each\n"
+			<< "host time:  " << seconds * 1000 << " ms\n"
+			<< "fps:        " << frames / seconds << " all together, "
+			<< options.frames / seconds << " per instance\n";
+		return 0;
+	}
+
+	// the same as RunBatch() but on one thread, through the lockstep core
+	int RunLockstep(Options options, const std::multimap<int, ScriptedInput>& inputs)
+	{
+		if (options.frames == 0)
+			options.frames = 600;
+
+		LockstepRunner lockstep{ options.rom, options.batch };
+		lockstep.SetVideoMode(VideoMode::TIMING_ONLY);
+
+		std::vector<uint8_t> buttons(lockstep.GetLaneCount());
+		uint8_t held = 0;
+		auto start = std::chrono::steady_clock::now();
+
+		for (int frame = 1; frame <= options.frames; frame++)
+		{
+			auto [first, last] = inputs.equal_range(frame);
+			for (auto input = first; input != last; ++input)
+			{
+				if (input->second.pressed)
+					held |= 1 << input->second.key;
+				else
+					held &= ~(1 << input->second.key);
+			}
+			std::fill(buttons.begin(), buttons.end(), held);
+			lockstep.Step(buttons.data());
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double frames = double(options.frames) * lockstep.GetLaneCount();
+		std::cout << std::fixed << std::setprecision(2)
+			<< "instances:  " << lockstep.GetLaneCount() << " in lockstep, "
+			<< 100.0 * lockstep.GetCounts().together / std::max<uint64_t>(lockstep.GetCounts().steps, 1) << "% of steps run together\n"
+			<< "frames:     " << options.frames << " each\n"
+			<< "host time:  " << seconds * 1000 << " ms\n"
+			<< "fps:        " << frames / seconds << " all together, "
+			<< options.frames / seconds << " per instance\n";
+		return 0;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options{};
+	if (!ParseOptions(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	std::multimap<int, ScriptedInput> inputs{};
+	if (!options.inputScript.empty() && !LoadInputScript(options.inputScript, inputs))
+		return 1;
+
+	if (!std::ifstream{ options.rom, std::ios::binary })
+	{
+		std::cerr << "Can't open ROM " << options.rom << "\n";
+		return 1;
+	}
+
+	if (options.batch > 0)
+		return options.lockstep ? RunLockstep(options, inputs) : RunBatch(options, inputs);
+
+	// the Emulator is too big for the stack
+	auto emu = std::make_unique<Emulator>();
+	emu->LoadGame(options.rom);
+
+	auto snapshot = std::make_unique<Emulator::Snapshot>();
+	if (!options.stateIn.empty())
+	{
+		std::vector<BYTE> data;
+		if (!ReadFile(options.stateIn, data) || !emu->LoadState(data.data(), data.size(), *snapshot))
+		{
+			std::cerr << "Can't load " << options.stateIn << ", it's missing or from another version or game\n";
+			return 1;
+		}
+		emu->RestoreSnapshot(*snapshot);
+	}
+
+	// a movie starts from its own state, or at power on
+	Movie movie{};
+	if (!options.play.empty())
+	{
+		std::vector<BYTE> data;
+		if (!ReadFile(options.play, data) || !movie.Load(data.data(), data.size()))
+		{
+			std::cerr << "Can't load movie " << options.play << "\n";
+			return 1;
+		}
+		if (!movie.StartPlayback(*emu))
+		{
+			std::cerr << options.play << " is for another game, or starts at power on and --state-in was given\n";
+			return 1;
+		}
+		if (options.frames == 0)
+			options.frames = static_cast<int>(movie.GetFrameCount());
+	}
+	else if (!options.record.empty())
+	{
+		movie.StartRecording(*emu);
+	}
+
+	if (options.frames == 0)
+		options.frames = 600;
+
+	// frames are counted from the start of this run, state or not
+	uint64_t startCycles = emu->GetCycleCount();
+
+	// minutes of history, so the numbers are for the whole run
+	std::unique_ptr<RewindBuffer> rewind{};
+	std::chrono::steady_clock::duration rewindTime{}, rewindWorst{};
+	if (options.rewindStats)
+		rewind = std::make_unique<RewindBuffer>(sizeof(Emulator::Snapshot::State), size_t(64) << 20);
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (int frame = 1; frame <= options.frames; frame++)
+	{
+		// input for a frame lands right at its start
+		auto [first, last] = inputs.equal_range(frame);
+		for (auto input = first; input != last; ++input)
+		{
+			if (!options.record.empty())
+				movie.Queue(*emu, emu->GetCycleCount(), input->second.key, input->second.pressed);
+			else
+				emu->QueueInput(emu->GetCycleCount(), input->second.key, input->second.pressed);
+		}
+
+		bool playing = !options.play.empty() && (size_t(frame) <= movie.GetFrameCount());
+		if (playing)
+			movie.QueueFrame(*emu, frame - 1);
+
+		// only draw the frames somebody asked for. Update() returns in
+		// vblank, so the mode applies to exactly this frame
+		bool dump = options.dumpFrames.contains(frame);
+		emu->SetVideoMode(dump ? VideoMode::FULL : VideoMode::TIMING_ONLY);
+		emu->Update();
+
+		if (playing && !movie.CheckFrame(*emu, frame - 1))
+		{
+			std::cerr << "Replay went its own way at frame " << frame << "\n";
+			return 2;
+		}
+		if (!options.record.empty())
+			movie.FrameDone(*emu);
+
+		if (rewind)
+		{
+			auto pushStart = std::chrono::steady_clock::now();
+			emu->TakeSnapshot(*snapshot);
+			rewind->Push(reinterpret_cast<const BYTE*>(&snapshot->state));
+			auto pushTime = std::chrono::steady_clock::now() - pushStart;
+			rewindTime += pushTime;
+			rewindWorst = std::max(rewindWorst, pushTime);
+		}
+
+		if (dump)
+		{
+			std::string path = "frame_" + std::to_string(frame) + ".ppm";
+			if (!WritePpm(path, *emu))
+			{
+				std::cerr << "Can't write " << path << "\n";
+				return 1;
+			}
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// a Game Boy runs 4194304 cycles a second
+	uint64_t cycles = emu->GetCycleCount() - startCycles;
+	double emulatedSeconds = cycles / 4194304.0;
+	std::cout << std::fixed << std::setprecision(2)
+		<< "frames:     " << options.frames << "\n"
+		<< "host time:  " << seconds * 1000 << " ms\n"
+		<< "fps:        " << options.frames / seconds << "\n"
+		<< "speed:      " << emulatedSeconds / seconds << "x real time\n"
+		<< "cycles/s:   " << cycles / seconds / 1e6 << " M\n";
+
+	if (!options.play.empty())
+		std::cout << "replay:     " << std::min<size_t>(options.frames, movie.GetFrameCount()) << " frames matched the movie\n";
+
+	if (rewind && rewind->GetFrames() > 0)
+	{
+		auto micros = [](std::chrono::steady_clock::duration time) {
+			return std::chrono::duration<double, std::micro>(time).count();
+		};
+		size_t frames = rewind->GetFrames();
+		std::cout << "rewind:     " << rewind->GetBytesUsed() / double(frames) << " bytes/frame, "
+			<< rewind->GetBytesUsed() * 60.0 / frames / 1024 << " KB per second of history\n"
+			<< "  push:     " << micros(rewindTime) / frames << " us average, " << micros(rewindWorst) << " us worst\n";
+
+		// stepping back, which also unpacks a keyframe every so often
+		auto popStart = std::chrono::steady_clock::now();
+		while (rewind->Pop(reinterpret_cast<BYTE*>(&snapshot->state)))
+			;
+		std::cout << "  pop:      " << micros(std::chrono::steady_clock::now() - popStart) / frames << " us average\n";
+	}
+
+	if (!options.record.empty())
+	{
+		std::vector<BYTE> data;
+		movie.Save(data);
+		if (!WriteFile(options.record, data))
+		{
+			std::cerr << "Can't write " << options.record << "\n";
+			return 1;
+		}
+	}
+
+	if (!options.stateOut.empty())
+	{
+		std::vector<BYTE> data;
+		emu->TakeSnapshot(*snapshot);
+		emu->SaveState(*snapshot, data);
+		if (!WriteFile(options.stateOut, data))
+		{
+			std::cerr << "Can't write " << options.stateOut << "\n";
+			return 1;
+		}
+	}
+
+	if (options.stateBench > 0)
+		BenchState(*emu, options.stateBench);
+
+	return 0;
+}
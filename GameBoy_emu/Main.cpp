@@ -2,8 +2,19 @@
 #include <SDL3/SDL_main.h>
 
 #include "Emulator/Emulator.h"
+#include "Emulator/Misc/Movie.h"
+#include "Emulator/Misc/RewindBuffer.h"
+#include "Emulator/Misc/SpscQueue.h"
+#include "Emulator/Misc/TripleBuffer.h"
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <future>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 constexpr int WIDTH_MULT{ 4 };
 constexpr int HEIGHT_MULT{ 3 };
@@ -42,22 +53,509 @@ int GetKey(const SDL_Event& event) {
 	return key;
 }
 
-void DrawGraphics(SDL_Renderer*& renderer, const Emulator& emu) {
-	for (int x{ 0 }; x < 160; ++x)
-		for (int y{ 0 }; y < 144; ++y) {
-			BYTE r{ emu.m_ScreenData[x][y][0] };
-			BYTE g{ emu.m_ScreenData[x][y][1] };
-			BYTE b{ emu.m_ScreenData[x][y][2] };
-			SDL_SetRenderDrawColor(renderer, r, g, b, SDL_ALPHA_OPAQUE);
-			for (int yy{ y * HEIGHT_MULT }; yy < (y + 1) * HEIGHT_MULT; ++yy)
-				for (int xx{ x * WIDTH_MULT }; xx < (x + 1) * WIDTH_MULT; ++xx) {
-					SDL_RenderPoint(renderer, xx, yy);
-				}
+// One Game Boy frame is 70224 cycles at 4194304 Hz, about 59.73 frames a second
+constexpr double FRAME_RATE{ 4194304.0 / 70224.0 };
+constexpr Uint64 FRAME_NS{ static_cast<Uint64>(SDL_NS_PER_SECOND / FRAME_RATE) };
+
+// a few minutes of rewind, games take about 50-85KB per second of it
+constexpr size_t REWIND_BYTES{ 16 << 20 };
+
+// Deadlines of the frames. Each one is worked out from the start time and the
+// frame count rather than added up, so the rounding of FRAME_NS never drifts
+struct FramePacer {
+	// 70224 cycles at 4194304 (2^22) Hz is exactly 137156250000 / 8192 ns
+	static constexpr Uint64 FRAME_NS_TIMES_8192{ 137156250000ull };
+
+	Uint64 start{};
+	Uint64 frames{};
+	double speed{ 1 };	// 0 = as fast as the host can go
+
+	void Restart(Uint64 now) {
+		start = now;
+		frames = 0;
+	}
+
+	Uint64 Deadline() const {
+		if (speed == 0)
+			return start;
+
+		// split up so the multiplication can't overflow
+		Uint64 emulated{ frames / 8192 * FRAME_NS_TIMES_8192
+			+ frames % 8192 * FRAME_NS_TIMES_8192 / 8192 };
+		return start + (speed == 1 ? emulated : static_cast<Uint64>(emulated / speed));
+	}
+
+	// faster than the screen can show it
+	bool Faster() const {
+		return speed == 0 || speed > 1;
+	}
+};
+
+// Stops drawing frames while the host can't keep up, so the game keeps
+// its speed instead of slowing down. Skipped frames still run, only in
+// VideoMode::TIMING_ONLY and without being presented
+struct FrameSkipper {
+	// never more than this many in a row, the picture shouldn't freeze
+	static constexpr int MAX_SKIP{ 4 };
+
+	int skippedInRow{};
+	int frames{};
+	int skipped{};
+	Uint64 hostTime{};
+
+	// late = how far behind schedule this frame starts
+	bool ShouldDraw(Uint64 late) {
+		if (late > FRAME_NS && skippedInRow < MAX_SKIP) {
+			++skippedInRow;
+			return false;
 		}
 
+		skippedInRow = 0;
+		return true;
+	}
+
+	// counts a finished frame and what it cost the host,
+	// about once a second says how many were skipped
+	void FrameDone(bool drawn, Uint64 time) {
+		++frames;
+		skipped += !drawn;
+		hostTime += time;
+
+		if (frames < 60)
+			return;
+
+		if (skipped > 0)
+			SDL_Log("frameskip: %d of %d frames skipped, %.2f ms host time per frame",
+				skipped, frames, hostTime / frames / 1e6);
+
+		frames = 0;
+		skipped = 0;
+		hostTime = 0;
+	}
+};
+
+// A finished frame on its way from the emulation thread to the main thread
+struct Frame {
+	BYTE pixels[144 * 160 * 4]{};	// RGBA8888, which is SDL_PIXELFORMAT_RGBA32
+	std::bitset<144> dirty{};		// lines changed since the frame numbered one less
+	Uint64 number{};
+};
+
+void DrawGraphics(SDL_Renderer* renderer, SDL_Texture* texture, const Frame& frame, bool allRows) {
+	constexpr int pitch{ 160 * 4 };
+
+	// only upload the runs of lines that changed since the last frame,
+	// unless some frames went by without being drawn
+	for (int y{ 0 }; y < 144;) {
+		if (!allRows && !frame.dirty.test(y)) {
+			++y;
+			continue;
+		}
+
+		int first{ y };
+		while (y < 144 && (allRows || frame.dirty.test(y)))
+			++y;
+
+		SDL_Rect rows{ 0, first, 160, y - first };
+		SDL_UpdateTexture(texture, &rows, frame.pixels + first * pitch, pitch);
+	}
+
+	// the renderer scales it up to the window
+	SDL_RenderClear(renderer);
+	SDL_RenderTexture(renderer, texture, nullptr, nullptr);
 	SDL_RenderPresent(renderer);
 }
 
+// What the main thread tells the emulation thread
+enum class CommandType {
+	KEY_DOWN,
+	KEY_UP,
+	PAUSE,	// toggles
+	FAST_FORWARD,	// key = 1 while held
+	REWIND,	// key = 1 while held
+	RESET,
+	SAVE_STATE,
+	LOAD_STATE,
+	RECORD,	// toggles
+	QUIT,
+};
+
+struct Command {
+	CommandType type{};
+	int key{};
+	Uint64 time{};	// host time of the key event, in ns
+};
+
+// Everything the two threads share. Neither ever waits for the other:
+// frames that aren't picked up in time get replaced, and commands
+// that don't fit in the queue are dropped
+struct EmulationShared {
+	TripleBuffer<Frame> frames{};
+	SpscQueue<Command, 256> commands{};
+};
+
+static std::string romPath{};
+
+// The frame about to run stands for the host time since the last one was due,
+// so a key lands as far into it as it came in after that deadline. Input then
+// lags by exactly one frame, whenever the host got around to looking at it
+static uint64_t InputCycle(const Emulator& emu, Uint64 lastDue, Uint64 time)
+{
+	Uint64 since{ std::min(time > lastDue ? time - lastDue : 0, FRAME_NS) };
+	return emu.GetCycleCount() + std::min<Uint64>(since * 4194304 / SDL_NS_PER_SECOND, 70223);
+}
+
+// Command line settings
+struct Options {
+	int runAhead{};			// frames shown ahead of where the game really is, 0 = off
+	bool runAheadThread{};	// run those on a second emulator on another core
+	double speed{ 1 };		// times real speed, 0 = as fast as the host can go
+	std::string play{};		// movie to play back instead of taking input
+};
+
+// Adds up the host time run-ahead takes, about once a second says how much
+struct RunAheadCost {
+	int frames{};
+	Uint64 time{};
+
+	void Add(Uint64 cost, int ahead, const char* where) {
+		++frames;
+		time += cost;
+
+		if (frames < 60)
+			return;
+
+		SDL_Log("run-ahead %d: %.2f ms extra host time per frame%s", ahead, time / frames / 1e6, where);
+		frames = 0;
+		time = 0;
+	}
+};
+
+// Runs `ahead` frames from where the emulator is, only drawing the last one into `frame`
+static void RunFramesAhead(Emulator& emu, int ahead, Frame& frame)
+{
+	emu.SetFrameBuffer(frame.pixels, 160 * 4, PixelFormat::RGBA8888);
+	for (int i{ 1 }; i <= ahead; ++i) {
+		emu.SetVideoMode(i == ahead ? VideoMode::FULL : VideoMode::TIMING_ONLY);
+		emu.Update();
+	}
+	frame.dirty = emu.GetDirtyRows();
+}
+
+// For running ahead on a second core: the real emulator hands its state over
+// after every frame, the other one picks up the newest and does all the drawing
+struct RunAheadShared {
+	TripleBuffer<Emulator::Snapshot> snapshots{};
+	std::atomic<Uint64> published{};
+	std::atomic<bool> stop{};
+};
+
+static void RunAheadLoop(int ahead, RunAheadShared& shared, TripleBuffer<Frame>& frames)
+{
+	auto emu{ std::make_unique<Emulator>() };
+	emu->LoadGame(romPath);
+	Uint64 seen{};
+	Uint64 frameNumber{};
+	RunAheadCost cost{};
+
+	while (true)
+	{
+		shared.published.wait(seen, std::memory_order_acquire);
+		if (shared.stop)
+			return;
+		seen = shared.published.load(std::memory_order_acquire);
+
+		if (!shared.snapshots.Update())
+			continue;
+
+		// no need to go back afterwards, the next state replaces it anyway
+		Uint64 start{ SDL_GetTicksNS() };
+		emu->RestoreSnapshot(shared.snapshots.Front());
+		Frame& frame{ frames.Back() };
+		RunFramesAhead(*emu, ahead, frame);
+		frame.number = ++frameNumber;
+		frames.Publish();
+		cost.Add(SDL_GetTicksNS() - start, ahead, " on its own thread");
+	}
+}
+
+// One save slot per game, next to the ROM
+static void SaveStateFile(Emulator& emu, Emulator::Snapshot& snapshot)
+{
+	std::string path{ romPath + ".state" };
+	std::vector<BYTE> data{};
+	emu.TakeSnapshot(snapshot);
+	emu.SaveState(snapshot, data);
+
+	if (SDL_SaveFile(path.c_str(), data.data(), data.size()))
+		SDL_Log("Saved state to %s", path.c_str());
+	else
+		SDL_Log("Couldn't save state to %s: %s", path.c_str(), SDL_GetError());
+}
+
+static void LoadStateFile(Emulator& emu, Emulator::Snapshot& snapshot)
+{
+	std::string path{ romPath + ".state" };
+	size_t size{};
+	void* data{ SDL_LoadFile(path.c_str(), &size) };
+	if (!data) {
+		SDL_Log("Couldn't load state from %s: %s", path.c_str(), SDL_GetError());
+		return;
+	}
+
+	if (emu.LoadState(static_cast<const BYTE*>(data), size, snapshot))
+		emu.RestoreSnapshot(snapshot);
+	else
+		SDL_Log("%s is from another version of the emulator or another game", path.c_str());
+	SDL_free(data);
+}
+
+// Movies also go next to the ROM, one per game like the save state
+static void SaveMovieFile(const Movie& movie)
+{
+	std::string path{ romPath + ".gbm" };
+	std::vector<uint8_t> data{};
+	movie.Save(data);
+
+	if (SDL_SaveFile(path.c_str(), data.data(), data.size()))
+		SDL_Log("Saved %zu frames of movie to %s", movie.GetFrameCount(), path.c_str());
+	else
+		SDL_Log("Couldn't save movie to %s: %s", path.c_str(), SDL_GetError());
+}
+
+static bool LoadMovieFile(Emulator& emu, Movie& movie, const std::string& path)
+{
+	size_t size{};
+	void* data{ SDL_LoadFile(path.c_str(), &size) };
+	if (!data) {
+		SDL_Log("Couldn't load movie from %s: %s", path.c_str(), SDL_GetError());
+		return false;
+	}
+
+	bool loaded{ movie.Load(static_cast<const uint8_t*>(data), size) && movie.StartPlayback(emu) };
+	SDL_free(data);
+	if (!loaded)
+		SDL_Log("%s is no movie of this game", path.c_str());
+	return loaded;
+}
+
+// Runs the game at its own pace on a separate thread, publishing every drawn frame
+static void EmulationLoop(std::unique_ptr<Emulator> emu, EmulationShared& shared, Options options)
+{
+	FramePacer pacer{};
+	pacer.speed = options.speed;
+	pacer.Restart(SDL_GetTicksNS());
+	FrameSkipper skipper{};
+	Uint64 frameNumber{};
+	Uint64 lastDue{ pacer.start };
+	Uint64 lastShown{};
+	bool paused{};
+
+	// the state every frame starts from goes in here, while rewinding they come
+	// back out one per frame. rewound = rewindSnapshot holds the one the frame
+	// on screen was run from
+	RewindBuffer rewind{ sizeof(Emulator::Snapshot::State), REWIND_BYTES };
+	auto rewindSnapshot{ std::make_unique<Emulator::Snapshot>() };
+	bool rewinding{};
+	bool rewound{};
+
+	// while a movie plays the keyboard is ignored, it has all the input.
+	// Going back in time would leave the movie behind, so no rewinding
+	// or loading states during one either
+	Movie movie{};
+	bool recording{};
+	bool playing{ !options.play.empty() && LoadMovieFile(*emu, movie, options.play) };
+	size_t movieFrame{};
+	auto stopMovie{ [&] {
+		if (recording)
+			SaveMovieFile(movie);
+		recording = false;
+		playing = false;
+	} };
+
+	// with run-ahead the real frames are never shown, only what comes after them
+	auto snapshot{ std::make_unique<Emulator::Snapshot>() };
+	RunAheadCost cost{};
+	std::unique_ptr<RunAheadShared> ahead{};
+	std::thread aheadThread{};
+	if (options.runAhead > 0 && options.runAheadThread) {
+		ahead = std::make_unique<RunAheadShared>();
+		aheadThread = std::thread(RunAheadLoop, options.runAhead, std::ref(*ahead), std::ref(shared.frames));
+	}
+
+	while (true)
+	{
+		Command command{};
+		while (shared.commands.TryPop(command)) {
+			switch (command.type) {
+			case CommandType::KEY_DOWN:
+			case CommandType::KEY_UP:
+				if (recording)
+					movie.Queue(*emu, InputCycle(*emu, lastDue, command.time), command.key, command.type == CommandType::KEY_DOWN);
+				else if (!playing)
+					emu->QueueInput(InputCycle(*emu, lastDue, command.time), command.key, command.type == CommandType::KEY_DOWN);
+				break;
+			case CommandType::PAUSE:
+				paused = !paused;
+				break;
+			case CommandType::FAST_FORWARD:
+				pacer.speed = command.key ? 0 : options.speed;
+				pacer.Restart(SDL_GetTicksNS());
+				break;
+			case CommandType::REWIND:
+				rewinding = command.key && !recording && !playing;
+				break;
+			case CommandType::RESET:
+				stopMovie();
+				// back to how the game was right after loading
+				emu->Reset();
+				rewind.Clear();
+				rewound = false;
+				break;
+			case CommandType::SAVE_STATE:
+				SaveStateFile(*emu, *snapshot);
+				break;
+			case CommandType::LOAD_STATE:
+				stopMovie();
+				LoadStateFile(*emu, *snapshot);
+				rewound = false;
+				break;
+			case CommandType::RECORD:
+				if (recording)
+					stopMovie();
+				else if (!playing) {
+					// from here on, with the state it's in as the start
+					movie = Movie{};
+					movie.StartRecording(*emu);
+					recording = true;
+					rewinding = false;
+					SDL_Log("Recording a movie");
+				}
+				break;
+			case CommandType::QUIT:
+				stopMovie();
+				if (aheadThread.joinable()) {
+					ahead->stop = true;
+					ahead->published.fetch_add(1, std::memory_order_release);
+					ahead->published.notify_one();
+					aheadThread.join();
+				}
+				return;
+			}
+		}
+
+		Uint64 current{ SDL_GetTicksNS() };
+
+		// the game picks up from here when it's unpaused
+		if (paused) {
+			SDL_DelayPrecise(FRAME_NS);
+			pacer.Restart(current);
+			continue;
+		}
+
+		// sleep until the frame is due, then look at the commands once more
+		Uint64 deadline{ pacer.Deadline() };
+		if (current < deadline) {
+			SDL_DelayPrecise(deadline - current);
+			continue;
+		}
+
+		// Update() returns in vblank, so the mode applies to the frame it runs
+		lastDue = deadline;
+
+		// running faster than real time, only draw as many frames as the screen shows
+		bool draw{ pacer.Faster() ? current - lastShown >= FRAME_NS : skipper.ShouldDraw(current - deadline) };
+		if (draw)
+			lastShown = current;
+
+		// The newest state is where the frame on screen started, so the first
+		// time round it's skipped and the frame before that is run and shown.
+		// Once the history runs out it stays on the oldest
+		BYTE* rewindState{ reinterpret_cast<BYTE*>(&rewindSnapshot->state) };
+		if (rewinding) {
+			bool popped{ rewind.Pop(rewindState) };
+			if (popped && !rewound && (rewind.GetFrames() > 0))
+				rewind.Pop(rewindState);
+			rewound = rewound || popped;
+			if (rewound) {
+				rewindSnapshot->inputs.clear();
+				emu->RestoreSnapshot(*rewindSnapshot);
+			}
+		}
+		else {
+			// where the frame on screen came from goes back in first, so none are lost
+			if (rewound)
+				rewind.Push(rewindState);
+			rewound = false;
+
+			emu->TakeSnapshot(*rewindSnapshot);
+			rewind.Push(rewindState);
+		}
+
+		if (playing)
+			movie.QueueFrame(*emu, movieFrame);
+
+		// on a second core the frames come from there, don't touch them here
+		Frame* frame{ ahead ? nullptr : &shared.frames.Back() };
+
+		if (options.runAhead == 0) {
+			emu->SetVideoMode(draw ? VideoMode::FULL : VideoMode::TIMING_ONLY);
+			emu->SetFrameBuffer(frame->pixels, 160 * 4, PixelFormat::RGBA8888);
+			emu->Update();
+			if (draw)
+				frame->dirty = emu->GetDirtyRows();
+		}
+		else {
+			emu->SetVideoMode(VideoMode::TIMING_ONLY);
+			emu->Update();
+
+			if (draw && ahead) {
+				emu->TakeSnapshot(ahead->snapshots.Back());
+				ahead->snapshots.Publish();
+				ahead->published.fetch_add(1, std::memory_order_release);
+				ahead->published.notify_one();
+			}
+			else if (draw) {
+				Uint64 start{ SDL_GetTicksNS() };
+				emu->TakeSnapshot(*snapshot);
+				RunFramesAhead(*emu, options.runAhead, *frame);
+				emu->RestoreSnapshot(*snapshot);
+				cost.Add(SDL_GetTicksNS() - start, options.runAhead, "");
+			}
+		}
+
+		// run-ahead has put the real state back by now
+		if (recording)
+			movie.FrameDone(*emu);
+		if (playing && !movie.CheckFrame(*emu, movieFrame)) {
+			SDL_Log("Replay went its own way at frame %zu", movieFrame + 1);
+			playing = false;
+		}
+		else if (playing && ++movieFrame == movie.GetFrameCount()) {
+			SDL_Log("Replay done, all %zu frames matched the movie", movieFrame);
+			playing = false;
+		}
+
+		if (draw && frame) {
+			frame->number = ++frameNumber;
+			shared.frames.Publish();
+		}
+		if (!pacer.Faster())
+			skipper.FrameDone(draw, SDL_GetTicksNS() - current);
+
+		// too far behind even with skipping, let the game slow down
+		++pacer.frames;
+		if (current > pacer.Deadline() + FrameSkipper::MAX_SKIP * FRAME_NS)
+			pacer.Restart(current);
+	}
+}
+
+static void SendCommand(EmulationShared& shared, CommandType type, int key = 0, Uint64 time = 0)
+{
+	if (!shared.commands.TryPush({ type, key, time }))
+		SDL_Log("Emulation thread isn't keeping up, command dropped");
+}
+
 static const SDL_DialogFileFilter filters[] = {
 	{ "GameBoy rom",  "gb" },
 };
@@ -80,6 +578,7 @@ static void SDLCALL callback(void* userdata, const char* const* filelist, int fi
 
 	if (*filelist) {
 		SDL_Log("Full path to selected file: '%s'", *filelist);
+		romPath = *filelist;
 		emu->LoadGame(*filelist);
 		emu->gameLoadStatus = 1;
 		return;
@@ -92,7 +591,10 @@ int main(int argc, char* argv[])
 	SDL_Renderer* renderer;
 	SDL_Event event;
 
-	Emulator emu{};
+	// belongs to the emulation thread once the game is loaded
+	auto emu{ std::make_unique<Emulator>() };
+	auto shared{ std::make_unique<EmulationShared>() };
+	std::thread emulation{};
 
 	SDL_SetAppMetadata("GameBoy Emulator", "1.0", "com.example.GameBoy_Emulator");
 
@@ -109,6 +611,32 @@ int main(int argc, char* argv[])
 		return 3;
 	}
 
+	SDL_Texture* texture{ SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
+		SDL_TEXTUREACCESS_STREAMING, 160, 144) };
+	if (!texture)
+	{
+		SDL_Log("Couldn't create texture: %s", SDL_GetError());
+		return 3;
+	}
+
+	// keep the pixels sharp when scaling up
+	SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_NEAREST);
+
+	Options options{};
+	for (int i{ 1 }; i < argc; ++i) {
+		std::string_view arg{ argv[i] };
+		if (arg == "--run-ahead" && i + 1 < argc)
+			options.runAhead = std::clamp(std::atoi(argv[++i]), 0, 8);
+		else if (arg == "--run-ahead-thread")
+			options.runAheadThread = true;
+		else if (arg == "--speed" && i + 1 < argc) {
+			std::string_view speed{ argv[++i] };
+			options.speed = speed == "unlimited" ? 0 : std::clamp(std::atof(argv[i]), 0.25, 64.0);
+		}
+		else if (arg == "--play" && i + 1 < argc)
+			options.play = argv[++i];
+	}
+
 	/*if (argc < 2) {
 		std::cout << "Usage: .\\GameBoy_emu.exe [rom_path]";
 		return 1;
@@ -116,45 +644,81 @@ int main(int argc, char* argv[])
 	emu.LoadGame(argv[1]);*/
 
 	auto aboba = std::async(std::launch::deferred, SDL_ShowOpenFileDialog,
-		callback, &emu, nullptr, filters, 1, "", false);
+		callback, emu.get(), nullptr, filters, 1, "", false);
 
 	aboba.wait();
 
-	constexpr double fps{ 60 };
-	constexpr double interval{ 1000 / fps };
-
-	Uint64 time2{ SDL_GetTicks() };
+	// nothing is on the texture yet, so the first frame goes up whole
+	Uint64 lastFrame{ ~0ull };
+	bool running{ true };
 
-	while (true)
+	while (running)
 	{
-		if (emu.gameLoadStatus == -1)
+		if (emu && emu->gameLoadStatus == -1)
 		{
 			SDL_Log("You should load valid Game Boy rom (*.gb)");
 			return -1;
 		}
 
-		SDL_PollEvent(&event);
-		if (event.type == SDL_EVENT_KEY_DOWN) {
-			int key{ GetKey(event) };
-			if (key != -1)
-				emu.KeyPressed(key);
-		}
-		else if (event.type == SDL_EVENT_KEY_UP) {
-			int key{ GetKey(event) };
-			if (key != -1)
-				emu.KeyReleased(key);
+		if (emu && emu->gameLoadStatus == 1)
+			emulation = std::thread(EmulationLoop, std::move(emu), std::ref(*shared), options);
+
+		// hand everything that came in over to the emulation thread
+		while (SDL_PollEvent(&event)) {
+			if (event.type == SDL_EVENT_KEY_DOWN) {
+				if (event.key.scancode == SDL_SCANCODE_P && !event.key.repeat)
+					SendCommand(*shared, CommandType::PAUSE);
+				else if (event.key.scancode == SDL_SCANCODE_R && !event.key.repeat)
+					SendCommand(*shared, CommandType::RESET);
+				else if (event.key.scancode == SDL_SCANCODE_TAB && !event.key.repeat)
+					SendCommand(*shared, CommandType::FAST_FORWARD, 1);
+				else if (event.key.scancode == SDL_SCANCODE_BACKSPACE && !event.key.repeat)
+					SendCommand(*shared, CommandType::REWIND, 1);
+				else if (event.key.scancode == SDL_SCANCODE_F5 && !event.key.repeat)
+					SendCommand(*shared, CommandType::SAVE_STATE);
+				else if (event.key.scancode == SDL_SCANCODE_F9 && !event.key.repeat)
+					SendCommand(*shared, CommandType::LOAD_STATE);
+				else if (event.key.scancode == SDL_SCANCODE_F6 && !event.key.repeat)
+					SendCommand(*shared, CommandType::RECORD);
+
+				int key{ GetKey(event) };
+				if (key != -1)
+					SendCommand(*shared, CommandType::KEY_DOWN, key, event.key.timestamp);
+			}
+			else if (event.type == SDL_EVENT_KEY_UP) {
+				if (event.key.scancode == SDL_SCANCODE_TAB)
+					SendCommand(*shared, CommandType::FAST_FORWARD, 0);
+				else if (event.key.scancode == SDL_SCANCODE_BACKSPACE)
+					SendCommand(*shared, CommandType::REWIND, 0);
+
+				int key{ GetKey(event) };
+				if (key != -1)
+					SendCommand(*shared, CommandType::KEY_UP, key, event.key.timestamp);
+			}
+			else if (event.type == SDL_EVENT_QUIT)
+				running = false;
 		}
-		else if (event.type == SDL_EVENT_QUIT)
-			return 0;
 
-		Uint64 current{ SDL_GetTicks() };
-		if (time2 + interval < current && emu.gameLoadStatus == 1) {
-			emu.Update();
-			DrawGraphics(renderer, emu);
-			time2 = current;
+		// show the newest frame if there is one. If one went by
+		// without being shown every line has to go up
+		if (shared->frames.Update()) {
+			const Frame& frame{ shared->frames.Front() };
+			DrawGraphics(renderer, texture, frame, frame.number != lastFrame + 1);
+			lastFrame = frame.number;
+		}
+		else {
+			SDL_DelayPrecise(FRAME_NS / 4);
 		}
 	}
 
+	// the queue empties quickly once the thread is told to stop
+	if (emulation.joinable()) {
+		while (!shared->commands.TryPush({ CommandType::QUIT }))
+			std::this_thread::yield();
+		emulation.join();
+	}
+
+	SDL_DestroyTexture(texture);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 
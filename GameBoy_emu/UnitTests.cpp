@@ -1,8 +1,19 @@
 #include <gtest/gtest.h>
 #include <map>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 
 #include "Emulator/Emulator.h"
+#include "Emulator/Misc/BatchRunner.h"
 #include "Emulator/Misc/BitOps.h"
+#include "Emulator/Misc/CpuFeatures.h"
+#include "Emulator/Misc/GymEnv.h"
+#include "Emulator/Misc/LockstepRunner.h"
+#include "Emulator/Misc/Movie.h"
+#include "Emulator/Misc/PixelKernels.h"
+#include "Emulator/Misc/RewindBuffer.h"
+#include "Emulator/Misc/TripleBuffer.h"
 
 #define MORE_DEBUG
 
@@ -14,6 +25,25 @@ struct EmulatorTest : public testing::Test
 	void TearDown() { }
 };
 
+// `program` at 0x100 of an otherwise empty cartridge, as a file for LoadGame()
+// named after the running test, and gone again with it
+struct TestRom
+{
+	explicit TestRom(std::initializer_list<BYTE> program)
+		: path(testing::TempDir() + testing::UnitTest::GetInstance()->current_test_info()->name() + ".gb")
+	{
+		std::vector<BYTE> rom(0x8000);
+		std::copy(program.begin(), program.end(), rom.begin() + 0x100);
+		std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(rom.data()), rom.size());
+	}
+	~TestRom() { std::remove(path.c_str()); }
+
+	TestRom(const TestRom&) = delete;
+	TestRom& operator=(const TestRom&) = delete;
+
+	std::string path;
+};
+
 TEST_F(EmulatorTest, Foo) 
 {
 	EXPECT_EQ(emu.A, 0x01);
@@ -57,7 +87,7 @@ TEST_F(EmulatorTest, CPUTest)
 	WORD& DE{ emu.DE };
 	WORD& HL{ emu.HL };
 
-	BYTE* rom{ emu.m_Rom };
+	auto rom = [this](WORD address) -> BYTE& { return emu.GetWritableMemory(address); };
 	
 	//==============================================
 	// 8 bit loads
@@ -80,7 +110,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(B, 9);
 
 	// LD r8, n8: 0b00'xxx'110
-	rom[PC] = 0x4D;
+	rom(PC) = 0x4D;
 	emu.ExecuteOpcode(0b00'001'110);
 	EXPECT_EQ(C, 0x4D);
 
@@ -88,77 +118,77 @@ TEST_F(EmulatorTest, CPUTest)
 	HL = 0xC000;
 	B = 0x7D;
 	emu.ExecuteOpcode(0b01'110'000);
-	EXPECT_EQ(rom[0xC000], 0x7D);
+	EXPECT_EQ(rom(0xC000), 0x7D);
 
 	// LD r8, [HL]: 0b01'xxx'110
 	emu.ExecuteOpcode(0b01'010'110);
 	EXPECT_EQ(D, 0x7D);
 
 	// LD [HL], n8: 0x36
-	rom[PC] = 0xE7;
+	rom(PC) = 0xE7;
 	emu.ExecuteOpcode(0x36);
-	EXPECT_EQ(rom[0xC000], 0xE7);
+	EXPECT_EQ(rom(0xC000), 0xE7);
 
 	// LD A, [BC]: 0x0A
 	BC = 0xC123;
-	rom[BC] = 0xDE;
+	rom(BC) = 0xDE;
 	emu.ExecuteOpcode(0x0A);
 	EXPECT_EQ(A, 0xDE);
 
 	// LD A, [DE]: 0x1A
 	DE = 0xC123;
-	rom[DE] = 0xF6;
+	rom(DE) = 0xF6;
 	emu.ExecuteOpcode(0x1A);
 	EXPECT_EQ(A, 0xF6);
 
 	// LD [BC], A: 0x02
 	A = 0x2D;
 	emu.ExecuteOpcode(0x02);
-	EXPECT_EQ(rom[BC], 0x2D);
+	EXPECT_EQ(rom(BC), 0x2D);
 
 	// LD [DE], A: 0x12
 	A = 0x2D;
 	emu.ExecuteOpcode(0x12);
-	EXPECT_EQ(rom[DE], 0x2D);
+	EXPECT_EQ(rom(DE), 0x2D);
 
 	// LD A, [n16]: 0xFA
-	rom[PC] = 0x23;
-	rom[PC + 1] = 0xC1;
-	rom[0xC123] = 0x3C;
+	rom(PC) = 0x23;
+	rom(PC + 1) = 0xC1;
+	rom(0xC123) = 0x3C;
 	emu.ExecuteOpcode(0xFA);
 	EXPECT_EQ(A, 0x3C);
 
 	// LD [n16], A: 0xEA
-	rom[PC] = 0x23;
-	rom[PC + 1] = 0xC1;
+	rom(PC) = 0x23;
+	rom(PC + 1) = 0xC1;
 	A = 0x1B;
 	emu.ExecuteOpcode(0xEA);
-	EXPECT_EQ(rom[0xC123], 0x1B);
+	EXPECT_EQ(rom(0xC123), 0x1B);
 
 	// LDH A, [C]: 0xF2
 	C = 0x3A;
-	rom[0xFF3A] = 0x36;
+	rom(0xFF3A) = 0x36;
 	emu.ExecuteOpcode(0xF2);
 	EXPECT_EQ(A, 0x36);
 
 	// LDH [C], A: 0xE2
 	emu.ExecuteOpcode(0xE2);
-	EXPECT_EQ(rom[0xFF3A], 0x36);
+	EXPECT_EQ(rom(0xFF3A), 0x36);
 
 	// LDH A, [n16]: 0xF0
-	rom[PC] = 0x23;
-	rom[0xFF23] = 0x13;
+	rom(PC) = 0x23;
+	rom(0xFF23) = 0x13;
 	emu.ExecuteOpcode(0xF0);
 	EXPECT_EQ(A, 0x13);
 
 	// LDH [n16], A: 0xE0
-	rom[PC] = 0x23;
+	rom(PC) = 0x23;
 	emu.ExecuteOpcode(0xE0);
-	EXPECT_EQ(rom[0xFF23], 0x13);
+	EXPECT_EQ(rom(0xFF23), 0x13);
 
 	// LD A, [HL-]: 0x3A
 	HL = 0xC123;
-	rom[0xC123] = 0x15;
+	rom(0xC123) = 0x15;
 	emu.ExecuteOpcode(0x3A);
 	EXPECT_EQ(A, 0x15);
 	EXPECT_EQ(HL, 0xC122);
@@ -166,12 +196,12 @@ TEST_F(EmulatorTest, CPUTest)
 	// LD [HL-], A: 0x32
 	HL = 0xC123;
 	emu.ExecuteOpcode(0x32);
-	EXPECT_EQ(rom[0xC123], 0x15);
+	EXPECT_EQ(rom(0xC123), 0x15);
 	EXPECT_EQ(HL, 0xC122);
 
 	// LD A, [HL+]: 0x2A
 	HL = 0xC123;
-	rom[0xC123] = 0x15;
+	rom(0xC123) = 0x15;
 	emu.ExecuteOpcode(0x2A);
 	EXPECT_EQ(A, 0x15);
 	EXPECT_EQ(HL, 0xC124);
@@ -179,22 +209,22 @@ TEST_F(EmulatorTest, CPUTest)
 	// LD [HL+], A: 0x22
 	HL = 0xC123;
 	emu.ExecuteOpcode(0x22);
-	EXPECT_EQ(rom[0xC123], 0x15);
+	EXPECT_EQ(rom(0xC123), 0x15);
 	EXPECT_EQ(HL, 0xC124);
 
 	// LD r16, n16: 0b00'xx'0001
-	rom[PC] = 0xDE;
-	rom[PC + 1] = 0x73;
+	rom(PC) = 0xDE;
+	rom(PC + 1) = 0x73;
 	emu.ExecuteOpcode(0b00'10'0001);
 	EXPECT_EQ(HL, 0x73DE);
 
 	// LD [n16], SP: 0x08
-	rom[PC] = 0xA0;
-	rom[PC + 1] = 0xC6;
+	rom(PC) = 0xA0;
+	rom(PC + 1) = 0xC6;
 	SP = 0xFFFE;
 	emu.ExecuteOpcode(0x08);
-	EXPECT_EQ(rom[0xC6A0], 0xFE);
-	EXPECT_EQ(rom[0xC6A1], 0xFF);
+	EXPECT_EQ(rom(0xC6A0), 0xFE);
+	EXPECT_EQ(rom(0xC6A1), 0xFF);
 
 	// LD SP, HL: 0xF9
 	HL = 0xFF73;
@@ -204,8 +234,8 @@ TEST_F(EmulatorTest, CPUTest)
 	// PUSH r16: 0b11'xx'0101
 	AF = 0x5AD2;
 	emu.ExecuteOpcode(0b11'11'0101);
-	EXPECT_EQ(rom[SP], 0xD2);
-	EXPECT_EQ(rom[SP + 1], 0x5A);
+	EXPECT_EQ(rom(SP), 0xD2);
+	EXPECT_EQ(rom(SP + 1), 0x5A);
 
 	// POP r16: 0b11'xx'0001
 	AF = 0x3211;
@@ -214,12 +244,12 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// LD HL, SP+e8: 0xF8
 	SP = 0xFFFE;
-	rom[PC] = 0xFE;
+	rom(PC) = 0xFE;
 	emu.ExecuteOpcode(0xF8);
 	EXPECT_EQ(HL, 0xFFFC);
 
 	SP = 0xFF73;
-	rom[PC] = 0x05;
+	rom(PC) = 0x05;
 	emu.ExecuteOpcode(0xF8);
 	EXPECT_EQ(HL, 0xFF78);
 	//||||||||||||||||||||||||||||||||||||||||||||||
@@ -234,14 +264,14 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// ADD A, [HL]: 0x86
 	HL = 0xCFB7;
-	rom[HL] = 7;
+	rom(HL) = 7;
 	A = 3;
 	emu.ExecuteOpcode(0x86);
 	EXPECT_EQ(A, 10);
 
 	// ADD A, n8: 0xC6
 	A = 15;
-	rom[PC] = 17;
+	rom(PC) = 17;
 	emu.ExecuteOpcode(0xC6);
 	EXPECT_EQ(A, 32);
 
@@ -253,7 +283,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// ADC A, [HL]: 0x8E
 	HL = 0xCFB7;
-	rom[HL] = 7;
+	rom(HL) = 7;
 	A = 3;
 	F = BitSet(F, emu.FLAG_C);
 	emu.ExecuteOpcode(0x8E);
@@ -261,7 +291,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// ADC A, n8: 0xCE
 	A = 15;
-	rom[PC] = 17;
+	rom(PC) = 17;
 	F = BitSet(F, emu.FLAG_C);
 	emu.ExecuteOpcode(0xCE);
 	EXPECT_EQ(A, 33);
@@ -274,14 +304,14 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// SUB A, [HL]: 0x96
 	HL = 0xCFB7;
-	rom[HL] = 7;
+	rom(HL) = 7;
 	A = 10;
 	emu.ExecuteOpcode(0x96);
 	EXPECT_EQ(A, 3);
 
 	// SUB A, n8: 0xD6
 	A = 15;
-	rom[PC] = 9;
+	rom(PC) = 9;
 	emu.ExecuteOpcode(0xD6);
 	EXPECT_EQ(A, 6);
 
@@ -294,7 +324,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// SBC A, [HL]: 0x9E
 	HL = 0xCFB7;
-	rom[HL] = 7;
+	rom(HL) = 7;
 	A = 14;
 	F = BitSet(F, emu.FLAG_C);
 	emu.ExecuteOpcode(0x9E);
@@ -302,7 +332,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// SBC A, n8: 0xDE
 	A = 17;
-	rom[PC] = 15;
+	rom(PC) = 15;
 	F = BitSet(F, emu.FLAG_C);
 	emu.ExecuteOpcode(0xDE);
 	EXPECT_EQ(A, 1);
@@ -337,7 +367,7 @@ TEST_F(EmulatorTest, CPUTest)
 	// CP A, [HL]: 0xBE
 	A = 112;
 	HL = 0xC123;
-	rom[HL] = 112;
+	rom(HL) = 112;
 	emu.ExecuteOpcode(0xBE);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], true);
@@ -347,7 +377,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// CP A, n8: 0xFE
 	A = 203;
-	rom[PC] = 203;
+	rom(PC) = 203;
 	emu.ExecuteOpcode(0xFE);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], true);
@@ -362,9 +392,9 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// INC [HL]: 0x34
 	HL = 0xC6A3;
-	rom[HL] = 15;
+	rom(HL) = 15;
 	emu.ExecuteOpcode(0x34);
-	EXPECT_EQ(rom[HL], 16);
+	EXPECT_EQ(rom(HL), 16);
 
 	// DEC r8: 0b00'xxx'101
 	A = 7;
@@ -373,9 +403,9 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// DEC [HL]: 0x35
 	HL = 0xC6A3;
-	rom[HL] = 15;
+	rom(HL) = 15;
 	emu.ExecuteOpcode(0x35);
-	EXPECT_EQ(rom[HL], 14);
+	EXPECT_EQ(rom(HL), 14);
 
 	// AND A, r8: 0b10'100'xxx
 	A = 0b1001'1011;
@@ -401,7 +431,7 @@ TEST_F(EmulatorTest, CPUTest)
 	// AND A, [HL]: 0xA6
 	A = 0b1001'1011;
 	HL = 0xC123;
-	rom[HL] = 0b1101'0101;
+	rom(HL) = 0b1101'0101;
 	emu.ExecuteOpcode(0xA6);
 	EXPECT_EQ(A, 0b1001'0001);
 	f = GetFlags(emu);
@@ -412,7 +442,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	A = 0b1001'1011;
 	HL = 0xC123;
-	rom[HL] = 0b0100'0100;
+	rom(HL) = 0b0100'0100;
 	emu.ExecuteOpcode(0xA6);
 	EXPECT_EQ(A, 0);
 	f = GetFlags(emu);
@@ -423,7 +453,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// AND A, n8: 0xE6
 	A = 0b1001'1011;
-	rom[PC] = 0b1101'0101;
+	rom(PC) = 0b1101'0101;
 	emu.ExecuteOpcode(0xE6);
 	EXPECT_EQ(A, 0b1001'0001);
 	f = GetFlags(emu);
@@ -433,7 +463,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	A = 0b1001'1011;
-	rom[PC] = 0b0100'0100;
+	rom(PC) = 0b0100'0100;
 	emu.ExecuteOpcode(0xE6);
 	EXPECT_EQ(A, 0);
 	f = GetFlags(emu);
@@ -466,7 +496,7 @@ TEST_F(EmulatorTest, CPUTest)
 	// OR A, [HL]: 0xB6
 	A = 0b1001'1011;
 	HL = 0xC123;
-	rom[HL] = 0b1101'0101;
+	rom(HL) = 0b1101'0101;
 	emu.ExecuteOpcode(0xB6);
 	EXPECT_EQ(A, 0b1101'1111);
 	f = GetFlags(emu);
@@ -477,7 +507,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	A = 0;
 	HL = 0xC123;
-	rom[HL] = 0;
+	rom(HL) = 0;
 	emu.ExecuteOpcode(0xB6);
 	EXPECT_EQ(A, 0);
 	f = GetFlags(emu);
@@ -488,7 +518,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// OR A, n8: 0xF6
 	A = 0b1001'1011;
-	rom[PC] = 0b1101'0101;
+	rom(PC) = 0b1101'0101;
 	emu.ExecuteOpcode(0xF6);
 	EXPECT_EQ(A, 0b1101'1111);
 	f = GetFlags(emu);
@@ -498,7 +528,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	A = 0;
-	rom[PC] = 0;
+	rom(PC) = 0;
 	emu.ExecuteOpcode(0xF6);
 	EXPECT_EQ(A, 0);
 	f = GetFlags(emu);
@@ -530,7 +560,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// XOR A, [HL]: 0xAE
 	A = 0b1001'1011;
-	rom[HL] = 0b1101'0101;
+	rom(HL) = 0b1101'0101;
 	emu.ExecuteOpcode(0xAE);
 	EXPECT_EQ(A, 0b0100'1110);
 	f = GetFlags(emu);
@@ -540,7 +570,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	A = 0b1001'1011;
-	rom[HL] = 0b1001'1011;
+	rom(HL) = 0b1001'1011;
 	emu.ExecuteOpcode(0xAE);
 	EXPECT_EQ(A, 0);
 	f = GetFlags(emu);
@@ -551,7 +581,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// XOR A, n8: 0xEE
 	A = 0b1001'1011;
-	rom[PC] = 0b1101'0101;
+	rom(PC) = 0b1101'0101;
 	emu.ExecuteOpcode(0xEE);
 	EXPECT_EQ(A, 0b0100'1110);
 	f = GetFlags(emu);
@@ -561,7 +591,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	A = 0b1001'1011;
-	rom[PC] = 0b1001'1011;
+	rom(PC) = 0b1001'1011;
 	emu.ExecuteOpcode(0xEE);
 	EXPECT_EQ(A, 0);
 	f = GetFlags(emu);
@@ -661,7 +691,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// ADD SP, e8: 0xE8
 	SP = 0xFFFE;
-	rom[PC] = -2;
+	rom(PC) = -2;
 	emu.ExecuteOpcode(0xE8);
 	EXPECT_EQ(SP, 0xFFFC);
 	f = GetFlags(emu);
@@ -671,7 +701,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	SP = 0xFFFC;
-	rom[PC] = 2;
+	rom(PC) = 2;
 	emu.ExecuteOpcode(0xE8);
 	EXPECT_EQ(SP, 0xFFFE);
 	f = GetFlags(emu);
@@ -767,7 +797,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// RLC r8: CB + 0b00'000'xxx
 	A = 0b1001'0110;
-	rom[PC] = 0b00'000'111;
+	rom(PC) = 0b00'000'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b101101);
 	f = GetFlags(emu);
@@ -777,7 +807,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], true);
 
 	A = 0b0001'0110;
-	rom[PC] = 0b00'000'111;
+	rom(PC) = 0b00'000'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b101100);
 	f = GetFlags(emu);
@@ -788,20 +818,20 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// RLC [HL]: CB + 0x06
 	HL = 0xC123;
-	rom[HL] = 0b1001'0110;
-	rom[PC] = 0x06;
+	rom(HL) = 0b1001'0110;
+	rom(PC) = 0x06;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b101101);
+	EXPECT_EQ(rom(HL), 0b101101);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
 	EXPECT_EQ(f['H'], false);
 	EXPECT_EQ(f['C'], true);
 
-	rom[HL] = 0b0001'0110;
-	rom[PC] = 0x06;
+	rom(HL) = 0b0001'0110;
+	rom(PC) = 0x06;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b101100);
+	EXPECT_EQ(rom(HL), 0b101100);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
@@ -810,7 +840,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// RRC r8: CB + 0b00'001'xxx
 	A = 0b1001'0110;
-	rom[PC] = 0b00'001'111;
+	rom(PC) = 0b00'001'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b1001011);
 	f = GetFlags(emu);
@@ -820,7 +850,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	A = 0b1001'0111;
-	rom[PC] = 0b00'001'111;
+	rom(PC) = 0b00'001'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b11001011);
 	f = GetFlags(emu);
@@ -830,20 +860,20 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], true);
 
 	// RRC [HL]: CB + 0x0E
-	rom[HL] = 0b1001'0110;
-	rom[PC] = 0x0E;
+	rom(HL) = 0b1001'0110;
+	rom(PC) = 0x0E;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b1001011);
+	EXPECT_EQ(rom(HL), 0b1001011);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
 	EXPECT_EQ(f['H'], false);
 	EXPECT_EQ(f['C'], false);
 
-	rom[HL] = 0b1001'0111;
-	rom[PC] = 0x0E;
+	rom(HL) = 0b1001'0111;
+	rom(PC) = 0x0E;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b11001011);
+	EXPECT_EQ(rom(HL), 0b11001011);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
@@ -853,7 +883,7 @@ TEST_F(EmulatorTest, CPUTest)
 	// RL r8: CB + 0b00'010'xxx
 	F = BitSet(F, emu.FLAG_C);
 	A = 0b0001'0110;
-	rom[PC] = 0x17;
+	rom(PC) = 0x17;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b101101);
 	f = GetFlags(emu);
@@ -864,7 +894,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	F = BitReset(F, emu.FLAG_C);
 	A = 0b1001'0111;
-	rom[PC] = 0x17;
+	rom(PC) = 0x17;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b101110);
 	f = GetFlags(emu);
@@ -875,10 +905,10 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// RL [HL]: CB + 0x16
 	F = BitSet(F, emu.FLAG_C);
-	rom[HL] = 0b0001'0110;
-	rom[PC] = 0x16;
+	rom(HL) = 0b0001'0110;
+	rom(PC) = 0x16;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b101101);
+	EXPECT_EQ(rom(HL), 0b101101);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
@@ -886,10 +916,10 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	F = BitReset(F, emu.FLAG_C);
-	rom[HL] = 0b1001'0111;
-	rom[PC] = 0x16;
+	rom(HL) = 0b1001'0111;
+	rom(PC) = 0x16;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b101110);
+	EXPECT_EQ(rom(HL), 0b101110);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
@@ -899,7 +929,7 @@ TEST_F(EmulatorTest, CPUTest)
 	// RR r8: CB + 0b00'011'xxx
 	F = BitSet(F, emu.FLAG_C);
 	A = 0b1001'0110;
-	rom[PC] = 0x1F;
+	rom(PC) = 0x1F;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b11001011);
 	f = GetFlags(emu);
@@ -910,7 +940,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	F = BitReset(F, emu.FLAG_C);
 	A = 0b1001'0111;
-	rom[PC] = 0x1F;
+	rom(PC) = 0x1F;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b1001011);
 	f = GetFlags(emu);
@@ -921,10 +951,10 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// RR [HL]: CB + 0x1E
 	F = BitSet(F, emu.FLAG_C);
-	rom[HL] = 0b1001'0110;
-	rom[PC] = 0x1E;
+	rom(HL) = 0b1001'0110;
+	rom(PC) = 0x1E;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b11001011);
+	EXPECT_EQ(rom(HL), 0b11001011);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
@@ -932,10 +962,10 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	F = BitReset(F, emu.FLAG_C);
-	rom[HL] = 0b1001'0111;
-	rom[PC] = 0x1E;
+	rom(HL) = 0b1001'0111;
+	rom(PC) = 0x1E;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b1001011);
+	EXPECT_EQ(rom(HL), 0b1001011);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
@@ -944,7 +974,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// SLA r8: CB + 0b00'100'xxx
 	A = 0b1001'0110;
-	rom[PC] = 0b00'100'111;
+	rom(PC) = 0b00'100'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b10'1100);
 	f = GetFlags(emu);
@@ -954,7 +984,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], true);
 
 	A = 0b1001'0111;
-	rom[PC] = 0b00'100'111;
+	rom(PC) = 0b00'100'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b10'1110);
 	f = GetFlags(emu);
@@ -964,20 +994,20 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], true);
 
 	// SLA [HL]: CB + 0x26
-	rom[HL] = 0b1001'0110;
-	rom[PC] = 0x26;
+	rom(HL) = 0b1001'0110;
+	rom(PC) = 0x26;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b10'1100);
+	EXPECT_EQ(rom(HL), 0b10'1100);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
 	EXPECT_EQ(f['H'], false);
 	EXPECT_EQ(f['C'], true);
 
-	rom[HL] = 0b1001'0111;
-	rom[PC] = 0x26;
+	rom(HL) = 0b1001'0111;
+	rom(PC) = 0x26;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b10'1110);
+	EXPECT_EQ(rom(HL), 0b10'1110);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
@@ -986,7 +1016,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// SRA r8: CB + 0b00'101'xxx
 	A = 0b1001'0111;
-	rom[PC] = 0b00'101'111;
+	rom(PC) = 0b00'101'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b1100'1011);
 	f = GetFlags(emu);
@@ -996,7 +1026,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], true);
 
 	A = 0b1001'0110;
-	rom[PC] = 0b00'101'111;
+	rom(PC) = 0b00'101'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b1100'1011);
 	f = GetFlags(emu);
@@ -1006,7 +1036,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	A = 0b0001'0110;
-	rom[PC] = 0b00'101'111;
+	rom(PC) = 0b00'101'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b0000'1011);
 	f = GetFlags(emu);
@@ -1016,30 +1046,30 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	// SRA [HL]: CB + 0x2E
-	rom[HL] = 0b1001'0111;
-	rom[PC] = 0x2E;
+	rom(HL) = 0b1001'0111;
+	rom(PC) = 0x2E;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b1100'1011);
+	EXPECT_EQ(rom(HL), 0b1100'1011);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
 	EXPECT_EQ(f['H'], false);
 	EXPECT_EQ(f['C'], true);
 
-	rom[HL] = 0b1001'0110;
-	rom[PC] = 0x2E;
+	rom(HL) = 0b1001'0110;
+	rom(PC) = 0x2E;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b1100'1011);
+	EXPECT_EQ(rom(HL), 0b1100'1011);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
 	EXPECT_EQ(f['H'], false);
 	EXPECT_EQ(f['C'], false);
 
-	rom[HL] = 0b0001'0110;
-	rom[PC] = 0x2E;
+	rom(HL) = 0b0001'0110;
+	rom(PC) = 0x2E;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b0000'1011);
+	EXPECT_EQ(rom(HL), 0b0000'1011);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
@@ -1048,7 +1078,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// SWAP r8: CB + 0b00'110'xxx
 	A = 0b1001'0110;
-	rom[PC] = 0b00'110'111;
+	rom(PC) = 0b00'110'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b0110'1001);
 	f = GetFlags(emu);
@@ -1058,7 +1088,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	A = 0;
-	rom[PC] = 0b00'110'111;
+	rom(PC) = 0b00'110'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0);
 	f = GetFlags(emu);
@@ -1068,20 +1098,20 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	// SWAP [HL]: CB + 0x36
-	rom[HL] = 0b1001'0110;
-	rom[PC] = 0x36;
+	rom(HL) = 0b1001'0110;
+	rom(PC) = 0x36;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b0110'1001);
+	EXPECT_EQ(rom(HL), 0b0110'1001);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
 	EXPECT_EQ(f['H'], false);
 	EXPECT_EQ(f['C'], false);
 
-	rom[HL] = 0;
-	rom[PC] = 0x36;
+	rom(HL) = 0;
+	rom(PC) = 0x36;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0);
+	EXPECT_EQ(rom(HL), 0);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], true);
 	EXPECT_EQ(f['N'], false);
@@ -1090,7 +1120,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// SRL r8: CB + 0b00'111'xxx
 	A = 0b1010'1101;
-	rom[PC] = 0b00'111'111;
+	rom(PC) = 0b00'111'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b101'0110);
 	f = GetFlags(emu);
@@ -1100,7 +1130,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], true);
 
 	A = 1;
-	rom[PC] = 0b00'111'111;
+	rom(PC) = 0b00'111'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0);
 	f = GetFlags(emu);
@@ -1110,7 +1140,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], true);
 
 	A = 0b1010'1100;
-	rom[PC] = 0b00'111'111;
+	rom(PC) = 0b00'111'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b101'0110);
 	f = GetFlags(emu);
@@ -1126,7 +1156,7 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// BIT u3, r8: 0b01'xxx'xxx
 	A = 0b1010'1100;
-	rom[PC] = 0b01'011'111;
+	rom(PC) = 0b01'011'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b1010'1100);
 	f = GetFlags(emu);
@@ -1136,7 +1166,7 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	A = 0b1010'1100;
-	rom[PC] = 0b01'100'111;
+	rom(PC) = 0b01'100'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b1010'1100);
 	f = GetFlags(emu);
@@ -1146,20 +1176,20 @@ TEST_F(EmulatorTest, CPUTest)
 	EXPECT_EQ(f['C'], false);
 
 	// BIT u3, [HL]: 0b01'xxx'110
-	rom[HL] = 0b1010'1100;
-	rom[PC] = 0b01'011'110;
+	rom(HL) = 0b1010'1100;
+	rom(PC) = 0b01'011'110;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b1010'1100);
+	EXPECT_EQ(rom(HL), 0b1010'1100);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], false);
 	EXPECT_EQ(f['N'], false);
 	EXPECT_EQ(f['H'], true);
 	EXPECT_EQ(f['C'], false);
 
-	rom[HL] = 0b1010'1100;
-	rom[PC] = 0b01'100'110;
+	rom(HL) = 0b1010'1100;
+	rom(PC) = 0b01'100'110;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b1010'1100);
+	EXPECT_EQ(rom(HL), 0b1010'1100);
 	f = GetFlags(emu);
 	EXPECT_EQ(f['Z'], true);
 	EXPECT_EQ(f['N'], false);
@@ -1168,27 +1198,27 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// RES u3, r8: 0b10'xxx'xxx
 	A = 0b1010'1100;
-	rom[PC] = 0b10'011'111;
+	rom(PC) = 0b10'011'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b1010'0100);
 
 	// RES u3, [HL]: 0b10'xxx'110
-	rom[HL] = 0b1010'1100;
-	rom[PC] = 0b10'101'110;
+	rom(HL) = 0b1010'1100;
+	rom(PC) = 0b10'101'110;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b1000'1100);
+	EXPECT_EQ(rom(HL), 0b1000'1100);
 
 	// SET u3, r8: 0b11'xxx'xxx
 	A = 0b1010'1100;
-	rom[PC] = 0b11'100'111;
+	rom(PC) = 0b11'100'111;
 	emu.ExecuteOpcode(0xCB);
 	EXPECT_EQ(A, 0b1011'1100);
 
 	// SET u3, [HL]: 0b11'xxx'110
-	rom[HL] = 0b1010'1100;
-	rom[PC] = 0b11'110'110;
+	rom(HL) = 0b1010'1100;
+	rom(PC) = 0b11'110'110;
 	emu.ExecuteOpcode(0xCB);
-	EXPECT_EQ(rom[HL], 0b1110'1100);
+	EXPECT_EQ(rom(HL), 0b1110'1100);
 
 	//||||||||||||||||||||||||||||||||||||||||||||||
 
@@ -1196,8 +1226,8 @@ TEST_F(EmulatorTest, CPUTest)
 	// Control flow
 	
 	// JP n16: 0xC3
-	rom[PC] = 0x34;
-	rom[PC + 1] = 0x12;
+	rom(PC) = 0x34;
+	rom(PC + 1) = 0x12;
 	emu.ExecuteOpcode(0xC3);
 	EXPECT_EQ(PC, 0x1234);
 
@@ -1209,7 +1239,7 @@ TEST_F(EmulatorTest, CPUTest)
 	// TODO: JP cc, n16: 0b110'xx'010
 
 	// JR n16: 0x18
-	rom[PC] = 5;
+	rom(PC) = 5;
 	emu.ExecuteOpcode(0x18);
 	EXPECT_EQ(PC, 0x106);
 
@@ -1217,13 +1247,13 @@ TEST_F(EmulatorTest, CPUTest)
 
 	// CALL n16: 0xCD
 	WORD PC_next = PC + 2;
-	rom[PC] = 0x34;
-	rom[PC + 1] = 0x12;
+	rom(PC) = 0x34;
+	rom(PC + 1) = 0x12;
 	SP = 0xFFFE;
 	emu.ExecuteOpcode(0xCD);
 	EXPECT_EQ(PC, 0x1234);
-	EXPECT_EQ(rom[SP], (PC_next & 0xF));
-	EXPECT_EQ(rom[SP + 1], PC_next >> 8);
+	EXPECT_EQ(rom(SP), (PC_next & 0xF));
+	EXPECT_EQ(rom(SP + 1), PC_next >> 8);
 
 	// TODO: CALL cc, n16: 0b110'xx'100
 
@@ -1255,9 +1285,835 @@ TEST_F(EmulatorTest, CPUTest)
 	//||||||||||||||||||||||||||||||||||||||||||||||
 }
 
+TEST_F(EmulatorTest, PaletteTables)
+{
+	// power on values: BGP = 0xFC, OBP0 = OBP1 = 0xFF
+	EXPECT_EQ(emu.m_Palettes[emu.BGP][0], emu.WHITE);
+	EXPECT_EQ(emu.m_Palettes[emu.BGP][1], emu.BLACK);
+	EXPECT_EQ(emu.m_Palettes[emu.OBP1][0], emu.BLACK);
+
+	// 0b00'01'10'11: id 0 is black, id 3 is white
+	emu.WriteMemory(0xFF48, 0x1B);
+	EXPECT_EQ(emu.m_Palettes[emu.OBP0][0], emu.BLACK);
+	EXPECT_EQ(emu.m_Palettes[emu.OBP0][1], emu.DARK_GRAY);
+	EXPECT_EQ(emu.m_Palettes[emu.OBP0][2], emu.LIGHT_GRAY);
+	EXPECT_EQ(emu.m_Palettes[emu.OBP0][3], emu.WHITE);
+	EXPECT_EQ(emu.ReadMemory(0xFF48), 0x1B);
+
+	// the other palettes are untouched
+	EXPECT_EQ(emu.m_Palettes[emu.OBP1][3], emu.BLACK);
+}
+
+TEST_F(EmulatorTest, SpriteLines)
+{
+	// 12 sprites on lines 20-27, x decreasing with the OAM index
+	for (int sprite = 0; sprite < 12; sprite++)
+	{
+		emu.WriteMemory(0xFE00 + sprite * 4, 20 + 16);
+		emu.WriteMemory(0xFE00 + sprite * 4 + 1, 100 - sprite);
+	}
+	// same x as sprite 3, comes later in OAM
+	emu.WriteMemory(0xFE00 + 39 * 4, 30 + 16);
+	emu.WriteMemory(0xFE00 + 39 * 4 + 1, 97);
+	emu.WriteMemory(0xFE00 + 3 * 4, 30 + 16);
+
+	emu.BuildSpriteLines(0x91);
+	EXPECT_FALSE(emu.m_SpritesDirty);
+
+	// only the first 10 in OAM order, smallest x first
+	const auto& line = emu.m_SpriteLines[20];
+	ASSERT_EQ(line.count, 10);
+	EXPECT_EQ(line.sprites[0], 10);
+	EXPECT_EQ(line.sprites[9], 0);
+	EXPECT_EQ(emu.m_SpriteLines[27].count, 10);
+	EXPECT_EQ(emu.m_SpriteLines[28].count, 0);
+
+	// equal x keeps OAM order
+	const auto& line30 = emu.m_SpriteLines[30];
+	ASSERT_EQ(line30.count, 2);
+	EXPECT_EQ(line30.sprites[0], 3);
+	EXPECT_EQ(line30.sprites[1], 39);
+
+	// 8x16 sprites reach further down
+	emu.WriteMemory(0xFF40, 0x95);
+	EXPECT_TRUE(emu.m_SpritesDirty);
+	emu.BuildSpriteLines(0x95);
+	EXPECT_EQ(emu.m_SpriteLines[35].count, 10);
+}
+
+TEST_F(EmulatorTest, FrameBufferFormats)
+{
+	// white, light gray, dark gray, black, repeated along the line
+	for (int pixel = 0; pixel < 160; pixel++)
+		emu.m_LineShades[pixel] = pixel % 4;
+
+	// caller owned, with padding at the end of every row
+	BYTE frame[144][160 * 4 + 16]{};
+	int pitch{ sizeof(frame[0]) };
+
+	emu.SetFrameBuffer(frame, pitch, PixelFormat::RGBA8888);
+	emu.OutputScanLine(2);
+	EXPECT_EQ(emu.GetFrameBuffer(), &frame[0][0]);
+	EXPECT_EQ(frame[2][0], 0xFF);
+	EXPECT_EQ(frame[2][3], 0xFF);
+	EXPECT_EQ(frame[2][4 + 0], 0xCC);
+	EXPECT_EQ(frame[2][12 + 2], 0x00);
+	EXPECT_EQ(frame[2][12 + 3], 0xFF);
+	EXPECT_EQ(frame[1][0], 0x00);
+	EXPECT_EQ(frame[2][160 * 4], 0x00);
+
+	emu.SetFrameBuffer(frame, pitch, PixelFormat::RGB565);
+	emu.OutputScanLine(3);
+	uint16_t colours[4]{};
+	std::memcpy(colours, frame[3], sizeof(colours));
+	EXPECT_EQ(colours[0], 0xFFFF);
+	EXPECT_EQ(colours[3], 0x0000);
+
+	emu.SetFrameBuffer(frame, pitch, PixelFormat::SHADE8);
+	emu.OutputScanLine(4);
+	EXPECT_EQ(frame[4][1], 1);
+	EXPECT_EQ(frame[4][159], 3);
+
+	emu.SetFrameBuffer(frame, pitch, PixelFormat::PACKED2BPP);
+	emu.OutputScanLine(5);
+	EXPECT_EQ(frame[5][0], 0b00'01'10'11);
+	EXPECT_EQ(frame[5][39], 0b00'01'10'11);
+	EXPECT_EQ(frame[5][40], 0x00);
+
+	// back to the internal buffer
+	emu.SetFrameBuffer(nullptr, 0, PixelFormat::SHADE8);
+	EXPECT_NE(emu.GetFrameBuffer(), &frame[0][0]);
+	EXPECT_EQ(emu.GetPixelFormat(), PixelFormat::RGBA8888);
+	EXPECT_EQ(emu.GetFramePitch(), 160 * 4);
+}
+
+TEST_F(EmulatorTest, LayerCache)
+{
+	BYTE frame[144][160]{};
+	emu.SetFrameBuffer(frame, 160, PixelFormat::SHADE8);
+	emu.WriteMemory(0xFF47, 0xE4); // identity palette
+
+	// map 0x9800 is all tile 0 (0x8000 with LCDC = 0x91), tile 1 has colour 3 everywhere
+	for (int i = 0; i < 16; i++)
+		emu.WriteMemory(0x8010 + i, 0xFF);
+
+	emu.GetWritableMemory(0xFF44) = 10;
+	emu.DrawScanLine();
+	EXPECT_EQ(frame[10][0], 0);
+
+	// point a map entry at tile 1, 8 pixels (tile column 2) turn black
+	emu.WriteMemory(0x9800 + 32 + 2, 1);
+	emu.DrawScanLine();
+	EXPECT_EQ(frame[10][15], 0);
+	EXPECT_EQ(frame[10][16], 3);
+	EXPECT_EQ(frame[10][23], 3);
+	EXPECT_EQ(frame[10][24], 0);
+
+	// rewriting the tile redraws the cell using it
+	emu.WriteMemory(0x8010 + 2 * 2, 0x0F);
+	emu.WriteMemory(0x8010 + 2 * 2 + 1, 0x00);
+	emu.DrawScanLine();
+	EXPECT_EQ(frame[10][16], 0);
+	EXPECT_EQ(frame[10][20], 1);
+
+	// scrolling wraps around the 256 pixel layer
+	emu.WriteMemory(0xFF43, 256 - 8);
+	emu.DrawScanLine();
+	EXPECT_EQ(frame[10][8 + 20], 1);
+	EXPECT_EQ(frame[10][8 + 15], 0);
+}
+
+TEST_F(EmulatorTest, RenderThread)
+{
+	Emulator threaded{};
+	threaded.SetRenderThread(true);
+	EXPECT_TRUE(threaded.IsRenderThreadEnabled());
+
+	// same writes on both, including mid frame scroll and palette changes
+	for (Emulator* e : { &emu, &threaded })
+	{
+		for (int i = 0; i < 0x1800; i++)
+			e->WriteMemory(0x8000 + i, i * 7);
+		for (int i = 0; i < 0x400; i++)
+			e->WriteMemory(0x9800 + i, i);
+		for (int i = 0; i < 0xA0; i++)
+			e->WriteMemory(0xFE00 + i, i * 13);
+		e->WriteMemory(0xFF40, 0x93);
+
+		for (int line = 0; line < 144; line++)
+		{
+			e->WriteMemory(0xFF43, line * 3);
+			if (line == 70)
+				e->WriteMemory(0xFF47, 0x1B);
+			e->GetWritableMemory(0xFF44) = line;
+			e->DrawScanLine();
+		}
+	}
+
+	threaded.SyncRenderThread();
+	EXPECT_EQ(0, std::memcmp(emu.GetFrameBuffer(), threaded.GetFrameBuffer(), 144 * 160 * 4));
+
+	// the CPU side still sees its writes
+	EXPECT_EQ(threaded.ReadMemory(0xFF47), 0x1B);
+
+	threaded.SetRenderThread(false);
+	EXPECT_FALSE(threaded.IsRenderThreadEnabled());
+}
+
+TEST_F(EmulatorTest, PixelFifo)
+{
+	Emulator fifo{};
+	fifo.SetPpuBackend(PpuBackend::FIFO);
+	EXPECT_EQ(fifo.GetPpuBackend(), PpuBackend::FIFO);
+
+	// a still picture with the window and sprites comes out the same on both
+	for (Emulator* e : { &emu, &fifo })
+	{
+		for (int i = 0; i < 0x1800; i++)
+			e->WriteMemory(0x8000 + i, i * 7);
+		for (int i = 0; i < 0x800; i++)
+			e->WriteMemory(0x9800 + i, i * 3);
+		for (int i = 0; i < 0xA0; i++)
+			e->WriteMemory(0xFE00 + i, i * 13);
+		e->WriteMemory(0xFF42, 5);
+		e->WriteMemory(0xFF43, 3);
+		e->WriteMemory(0xFF4A, 0);
+		e->WriteMemory(0xFF4B, 87);
+		e->WriteMemory(0xFF40, 0xE3);
+
+		for (int dot = 0; dot < 154 * 456; dot += 4)
+			e->UpdateGraphics(4);
+	}
+
+	// the scanline backend never draws line 0
+	EXPECT_EQ(0, std::memcmp(emu.GetFrameBuffer() + 160 * 4, fifo.GetFrameBuffer() + 160 * 4, 143 * 160 * 4));
+
+	// mode 3 gets longer with fine scroll and with every sprite on the line
+	auto mode3Length = [&fifo](int line) {
+		while (fifo.GetMemory(0xFF44) != line)
+			fifo.UpdateGraphics(1);
+		int dots = 0;
+		for (int dot = 0; dot < 456; dot++)
+		{
+			dots += (fifo.GetMemory(0xFF41) & 3) == 3;
+			fifo.UpdateGraphics(1);
+		}
+		return dots;
+	};
+
+	for (int i = 0; i < 0xA0; i++)
+		fifo.WriteMemory(0xFE00 + i, 0);
+	fifo.WriteMemory(0xFF40, 0x93);
+	fifo.WriteMemory(0xFF43, 0);
+	EXPECT_EQ(mode3Length(20), 172);
+
+	fifo.WriteMemory(0xFF43, 3);
+	EXPECT_EQ(mode3Length(30), 175);
+
+	fifo.WriteMemory(0xFE00, 40 + 16);
+	fifo.WriteMemory(0xFE01, 50);
+	EXPECT_GT(mode3Length(40), 175 + 5);
+}
+
+TEST_F(EmulatorTest, TimingOnly)
+{
+	Emulator timing{};
+	for (Emulator* e : { &emu, &timing })
+	{
+		// jr -2 forever, with the background all colour 3
+		e->GetWritableMemory(0x100) = 0x18;
+		e->GetWritableMemory(0x101) = 0xFE;
+		for (int i = 0; i < 16; i++)
+			e->WriteMemory(0x8000 + i, 0xFF);
+	}
+
+	// LY is 0, so it waits for the frame to end
+	timing.SetVideoMode(VideoMode::TIMING_ONLY);
+	EXPECT_EQ(timing.GetVideoMode(), VideoMode::FULL);
+	emu.Update();
+	timing.Update();
+	EXPECT_EQ(timing.GetVideoMode(), VideoMode::TIMING_ONLY);
+	EXPECT_EQ(timing.GetMemory(0xFF44), 144);
+
+	BYTE frame[144][160]{};
+	timing.SetFrameBuffer(frame, 160, PixelFormat::SHADE8);
+
+	// same timing, no pixels
+	for (int i = 0; i < 3; i++)
+	{
+		emu.Update();
+		timing.Update();
+		EXPECT_EQ(emu.GetMemory(0xFF44), timing.GetMemory(0xFF44));
+		EXPECT_EQ(emu.GetMemory(0xFF41), timing.GetMemory(0xFF41));
+		EXPECT_EQ(emu.GetMemory(0xFF0F), timing.GetMemory(0xFF0F));
+		EXPECT_EQ(emu.GetMemory(0xFF04), timing.GetMemory(0xFF04));
+	}
+	EXPECT_EQ(emu.GetFrameBuffer()[(10 * 160 + 10) * 4], 0x00);
+	EXPECT_EQ(frame[10][10], 0);
+
+	// and back, during vblank it's immediate
+	timing.SetVideoMode(VideoMode::FULL);
+	EXPECT_EQ(timing.GetVideoMode(), VideoMode::FULL);
+	timing.Update();
+	EXPECT_EQ(frame[10][10], 3);
+}
+
+TEST_F(EmulatorTest, DirtyRows)
+{
+	// jr -2 forever
+	emu.GetWritableMemory(0x100) = 0x18;
+	emu.GetWritableMemory(0x101) = 0xFE;
+
+	// everything is new on the first frame (line 0 is never drawn)
+	emu.Update();
+	EXPECT_EQ(emu.GetDirtyRows().count(), 143);
+
+	emu.Update();
+	EXPECT_TRUE(emu.GetDirtyRows().none());
+
+	// a tile in the third row of the map only touches lines 16-23
+	for (int i = 0; i < 16; i++)
+		emu.WriteMemory(0x8010 + i, 0xFF);
+	emu.WriteMemory(0x9800 + 2 * 32 + 5, 1);
+	emu.Update();
+	EXPECT_EQ(emu.GetDirtyRows().count(), 8);
+	EXPECT_TRUE(emu.GetDirtyRows().test(16));
+	EXPECT_TRUE(emu.GetDirtyRows().test(23));
+
+	// frames that aren't drawn change nothing
+	emu.WriteMemory(0x9800 + 2 * 32 + 5, 0);
+	emu.SetVideoMode(VideoMode::TIMING_ONLY);
+	emu.Update();
+	EXPECT_TRUE(emu.GetDirtyRows().none());
+}
+
+TEST_F(EmulatorTest, InputQueue)
+{
+	// jr -2 forever, the game looks at the standard buttons
+	emu.GetWritableMemory(0x100) = 0x18;
+	emu.GetWritableMemory(0x101) = 0xFE;
+	emu.WriteMemory(0xFF00, 0x10);
+
+	// out of order on purpose, one lands in each of the next two frames
+	emu.QueueInput(100000, 4, false);
+	emu.QueueInput(1000, 4, true);
+
+	emu.Update();
+	uint64_t frameEnd = emu.GetCycleCount();
+	EXPECT_GE(frameEnd, 1000);
+	EXPECT_LT(frameEnd, 100000);
+	EXPECT_FALSE(TestBit(emu.m_JoypadState, 4));
+	EXPECT_TRUE(TestBit(emu.GetMemory(0xFF0F), 4));
+
+	emu.Update();
+	EXPECT_TRUE(TestBit(emu.m_JoypadState, 4));
+
+	// only the keys that change are queued, held counts what's queued already
+	emu.SetHeldButtons(0x11);
+	EXPECT_EQ(emu.m_InputQueue.size(), 2u);
+	EXPECT_EQ(emu.GetHeldButtons(), 0x11);
+	emu.SetHeldButtons(0x31);
+	EXPECT_EQ(emu.m_InputQueue.size(), 3u);
+	emu.Update();
+	EXPECT_EQ(emu.m_JoypadState, 0xCE);
+	EXPECT_EQ(emu.GetHeldButtons(), 0x31);
+}
+
+TEST_F(EmulatorTest, Snapshot)
+{
+	// inc a / ld (0x9800),a / jr back, the top left tile keeps changing
+	const BYTE program[]{ 0x3C, 0xEA, 0x00, 0x98, 0x18, 0xFA };
+	std::copy_n(program, sizeof(program), &emu.GetWritableMemory(0x100));
+	for (int i = 0; i < 0x1000; i++)
+		emu.WriteMemory(0x8000 + i, i * 7);
+
+	emu.Update();
+	emu.QueueInput(emu.GetCycleCount() + 100000, 4, true);
+
+	auto snapshot = std::make_unique<Emulator::Snapshot>();
+	emu.TakeSnapshot(*snapshot);
+
+	auto runFrames = [this] {
+		for (int i = 0; i < 3; i++)
+			emu.Update();
+		return std::vector<BYTE>(emu.GetFrameBuffer(), emu.GetFrameBuffer() + 144 * 160 * 4);
+	};
+
+	std::vector<BYTE> frame = runFrames();
+	WORD pc = emu.PC;
+	BYTE a = emu.A;
+	uint64_t cycles = emu.GetCycleCount();
+	EXPECT_FALSE(TestBit(emu.m_JoypadState, 4));
+
+	// the same three frames again, from the caches' point of view the memory changed behind their back
+	emu.RestoreSnapshot(*snapshot);
+	EXPECT_TRUE(TestBit(emu.m_JoypadState, 4));
+	EXPECT_EQ(frame, runFrames());
+	EXPECT_EQ(emu.PC, pc);
+	EXPECT_EQ(emu.A, a);
+	EXPECT_EQ(emu.GetCycleCount(), cycles);
+	EXPECT_FALSE(TestBit(emu.m_JoypadState, 4));
+}
+
+TEST_F(EmulatorTest, SaveState)
+{
+	emu.m_RomHash = 0x1234;
+
+	// jr to itself
+	emu.GetWritableMemory(0x100) = 0x18;
+	emu.GetWritableMemory(0x101) = 0xFE;
+	for (int i = 0; i < 3; i++)
+		emu.Update();
+	emu.QueueInput(emu.GetCycleCount() + 5000, 7, true);
+
+	auto snapshot = std::make_unique<Emulator::Snapshot>();
+	emu.TakeSnapshot(*snapshot);
+	std::vector<BYTE> data;
+	emu.SaveState(*snapshot, data);
+
+	auto loaded = std::make_unique<Emulator::Snapshot>();
+	ASSERT_TRUE(emu.LoadState(data.data(), data.size(), *loaded));
+	EXPECT_EQ(std::memcmp(&loaded->state, &snapshot->state, sizeof(Emulator::Snapshot::State)), 0);
+	ASSERT_EQ(loaded->inputs.size(), 1u);
+	EXPECT_EQ(loaded->inputs[0].key, 7);
+
+	// out of range: a RAM bank, a ROM bank, a bool and an input's key,
+	// none of which touch the snapshot
+	size_t inputAt = data.size() - sizeof(Emulator::InputEvent);
+	size_t stateAt = inputAt - sizeof(Emulator::Snapshot::State);
+	const size_t badBytes[]{
+		stateAt + offsetof(Emulator::Snapshot::State, currentRAMBank),
+		stateAt + offsetof(Emulator::Snapshot::State, currentROMBank) + 1,
+		stateAt + offsetof(Emulator::Snapshot::State, halted),
+		inputAt + offsetof(Emulator::InputEvent, key),
+	};
+	loaded->state.pc = 0x4242;
+	for (size_t offset : badBytes)
+	{
+		std::vector<BYTE> bad = data;
+		bad[offset] = 0x40;
+		EXPECT_FALSE(emu.LoadState(bad.data(), bad.size(), *loaded));
+	}
+	EXPECT_EQ(loaded->state.pc, 0x4242);
+
+	// cut short, from another version or from another game
+	EXPECT_FALSE(emu.LoadState(data.data(), data.size() - 1, *loaded));
+	data[4]++;
+	EXPECT_FALSE(emu.LoadState(data.data(), data.size(), *loaded));
+	data[4]--;
+	emu.m_RomHash = 0x4321;
+	EXPECT_FALSE(emu.LoadState(data.data(), data.size(), *loaded));
+}
+
+TEST_F(EmulatorTest, Fork)
+{
+	// inc a / ld (0x9800),a / jr back, the top left tile keeps changing
+	const BYTE program[]{ 0x3C, 0xEA, 0x00, 0x98, 0x18, 0xFA };
+	std::copy_n(program, sizeof(program), &emu.GetWritableMemory(0x100));
+	emu.m_EnableRAM = true;
+	emu.WriteMemory(0xA000, 0x42);
+	emu.Update();
+
+	std::unique_ptr<Emulator> child = emu.Fork();
+	EXPECT_EQ(child->ReadMemory(0xA000), 0x42);
+	EXPECT_EQ(child->m_RAMPages[0], emu.m_RAMPages[0]);
+	EXPECT_EQ(child->m_CartridgeMemory, emu.m_CartridgeMemory);
+	EXPECT_EQ(child->m_MemoryPages, emu.m_MemoryPages);
+	// and has no frame of its own until it draws one
+	EXPECT_EQ(child->m_OwnedFrame, nullptr);
+
+	// a write only copies the page it lands on, for the side that made it
+	child->WriteMemory(0xA001, 0x43);
+	EXPECT_NE(child->m_RAMPages[0], emu.m_RAMPages[0]);
+	EXPECT_EQ(child->m_RAMPages[1], emu.m_RAMPages[1]);
+	EXPECT_EQ(emu.ReadMemory(0xA001), 0);
+	emu.WriteMemory(0xA001, 0x43);
+
+	const int page = 0xC000 / Emulator::RAM_PAGE_SIZE;
+	child->WriteMemory(0xC000, 0x44);
+	EXPECT_NE(child->m_MemoryPages[page], emu.m_MemoryPages[page]);
+	EXPECT_EQ(child->m_MemoryPages[page + 1], emu.m_MemoryPages[page + 1]);
+	EXPECT_EQ(emu.ReadMemory(0xC000), 0);
+	emu.WriteMemory(0xC000, 0x44);
+
+	// and from there on they run the same
+	for (int i = 0; i < 3; i++)
+	{
+		emu.Update();
+		child->Update();
+	}
+	EXPECT_EQ(child->GetCycleCount(), emu.GetCycleCount());
+	EXPECT_EQ(child->PC, emu.PC);
+	EXPECT_TRUE(std::equal(emu.GetFrameBuffer(), emu.GetFrameBuffer() + 144 * 160 * 4, child->GetFrameBuffer()));
+}
+
+TEST_F(EmulatorTest, Movie)
+{
+	// reads the buttons into 0xC000 over and over
+	const BYTE program[]{ 0x3E, 0x10, 0xE0, 0x00, 0xF0, 0x00, 0xEA, 0x00, 0xC0, 0x18, 0xF5 };
+	auto power = [&program] {
+		auto emu = std::make_unique<Emulator>();
+		std::copy_n(program, sizeof(program), &emu->GetWritableMemory(0x100));
+		return emu;
+	};
+
+	std::unique_ptr<Emulator> recorded = power();
+	Movie movie{};
+	movie.StartRecording(*recorded);
+	for (int frame = 0; frame < 6; frame++)
+	{
+		movie.Queue(*recorded, recorded->GetCycleCount() + frame * 9001, frame % 8, frame % 2 == 0);
+		recorded->Update();
+		movie.FrameDone(*recorded);
+	}
+
+	std::vector<BYTE> data;
+	movie.Save(data);
+	Movie loaded{};
+	ASSERT_TRUE(loaded.Load(data.data(), data.size()));
+	ASSERT_EQ(loaded.GetFrameCount(), 6u);
+
+	// a broken movie is turned away whole, the loaded one stays
+	std::vector<BYTE> broken = data;
+	broken.push_back(0);
+	EXPECT_FALSE(loaded.Load(broken.data(), broken.size()));
+	broken = data;
+	broken[broken.size() - 5] = 0x0D;	// the last frame's key 5 as 13
+	EXPECT_FALSE(loaded.Load(broken.data(), broken.size()));
+	broken = data;
+	broken.resize(broken.size() - 1);
+	EXPECT_FALSE(loaded.Load(broken.data(), broken.size()));
+	ASSERT_EQ(loaded.GetFrameCount(), 6u);
+
+	std::unique_ptr<Emulator> replay = power();
+	ASSERT_TRUE(loaded.StartPlayback(*replay));
+	for (size_t frame = 0; frame < loaded.GetFrameCount(); frame++)
+	{
+		loaded.QueueFrame(*replay, frame);
+		replay->Update();
+		EXPECT_TRUE(loaded.CheckFrame(*replay, frame)) << frame;
+	}
+	EXPECT_EQ(replay->GetStateHash(), recorded->GetStateHash());
+
+	// only from power on, or from the state it was recorded from
+	EXPECT_FALSE(loaded.StartPlayback(*replay));
+
+	// a different button shows up on the frame it's pressed in
+	std::unique_ptr<Emulator> other = power();
+	ASSERT_TRUE(loaded.StartPlayback(*other));
+	loaded.QueueFrame(*other, 0);
+	other->Update();
+	EXPECT_TRUE(loaded.CheckFrame(*other, 0));
+	other->QueueInput(other->GetCycleCount(), 5, true);
+	other->Update();
+	EXPECT_FALSE(loaded.CheckFrame(*other, 1));
+}
+
+TEST_F(EmulatorTest, Reset)
+{
+	// the Fork program as a cartridge, since Reset() goes back to what LoadGame() left
+	TestRom rom{ 0x3C, 0xEA, 0x00, 0x98, 0x18, 0xFA };
+	emu.LoadGame(rom.path);
+
+	emu.Update();
+	uint64_t firstFrame = emu.GetStateHash();
+	std::bitset<144> firstDirty = emu.GetDirtyRows();
+	for (int i = 0; i < 3; i++)
+		emu.Update();
+	emu.QueueInput(emu.GetCycleCount() + 100, 4, true);
+	const BYTE* lastShades = emu.m_LastShades.get();
+	ASSERT_NE(lastShades, nullptr);
+
+	// the same first frame again, drawn out whole, without the queued input
+	// and into the same buffers
+	emu.Reset();
+	EXPECT_EQ(emu.GetCycleCount(), 0u);
+	EXPECT_EQ(emu.PC, 0x100);
+	EXPECT_TRUE(emu.m_InputQueue.empty());
+	EXPECT_EQ(emu.m_LastShades.get(), lastShades);
+	emu.Update();
+	EXPECT_EQ(emu.GetStateHash(), firstFrame);
+	EXPECT_EQ(emu.GetDirtyRows(), firstDirty);
+	EXPECT_EQ(emu.m_LastShades.get(), lastShades);
+
+	// forks reset to the same place
+	std::unique_ptr<Emulator> child = emu.Fork();
+	child->Reset();
+	child->Update();
+	EXPECT_EQ(child->GetStateHash(), firstFrame);
+}
+
+TEST(PixelKernelsTest, LevelsMatchScalar)
+{
+	// 21 tile rows, the most a scanline can touch
+	BYTE planes[2 * 21];
+	for (int i = 0; i < 2 * 21; i++)
+		planes[i] = i * 37 + 11;
+
+	const PixelKernels* scalar{ GetPixelKernels(KernelLevel::SCALAR) };
+	BYTE expectedIds[8 * 21];
+	scalar->DecodeTileRows(planes, expectedIds, 21);
+
+	// pixel 0 is bit 7, hi plane is bit 1 of the colour id
+	EXPECT_EQ(expectedIds[0], BitGetVal(planes[0], 7) | (BitGetVal(planes[1], 7) << 1));
+	EXPECT_EQ(expectedIds[7], BitGetVal(planes[0], 0) | (BitGetVal(planes[1], 0) << 1));
+
+	const BYTE palette[4]{ 3, 0, 2, 1 };
+	BYTE expectedShades[8 * 21];
+	scalar->MapPalette(expectedIds, expectedShades, 8 * 21, palette);
+
+	// a whole frame line, odd weights and both ends
+	BYTE rowA[160], rowB[160];
+	for (int i = 0; i < 160; i++)
+	{
+		rowA[i] = static_cast<BYTE>(i * 53 + 7);
+		rowB[i] = static_cast<BYTE>(255 - i * 29);
+	}
+	const int weights[]{ 0, 1, 77, 128, 255, 256 };
+	BYTE expectedBlends[6][160];
+	for (int w = 0; w < 6; w++)
+		scalar->BlendRows(rowA, rowB, expectedBlends[w], 160, weights[w]);
+	EXPECT_EQ(0, std::memcmp(expectedBlends[0], rowA, 160));
+	EXPECT_EQ(0, std::memcmp(expectedBlends[5], rowB, 160));
+	EXPECT_EQ(expectedBlends[3][1], (rowA[1] + rowB[1] + 1) / 2);
+
+	for (KernelLevel level : { KernelLevel::SSE2, KernelLevel::AVX2 })
+	{
+		const PixelKernels* kernels{ GetPixelKernels(level) };
+		if (!kernels)
+			continue;
+
+		BYTE ids[8 * 21];
+		kernels->DecodeTileRows(planes, ids, 21);
+		EXPECT_EQ(0, std::memcmp(ids, expectedIds, sizeof(ids))) << kernels->name;
+
+		BYTE shades[8 * 21];
+		kernels->MapPalette(ids, shades, 8 * 21, palette);
+		EXPECT_EQ(0, std::memcmp(shades, expectedShades, sizeof(shades))) << kernels->name;
+
+		for (int w = 0; w < 6; w++)
+		{
+			BYTE blend[160];
+			kernels->BlendRows(rowA, rowB, blend, 160, weights[w]);
+			EXPECT_EQ(0, std::memcmp(blend, expectedBlends[w], sizeof(blend))) << kernels->name << " " << weights[w];
+		}
+	}
+}
+
+TEST(TripleBufferTest, ReaderSeesNewestInOrder)
+{
+	TripleBuffer<int> buffer{};
+	EXPECT_FALSE(buffer.Update());
+
+	buffer.Back() = 1;
+	buffer.Publish();
+	buffer.Back() = 2;
+	buffer.Publish();
+	EXPECT_TRUE(buffer.Update());
+	EXPECT_EQ(buffer.Front(), 2);
+	EXPECT_FALSE(buffer.Update());
+
+	// values only ever go up on the reader side, and the last one arrives
+	constexpr int COUNT{ 100000 };
+	std::thread writer([&buffer] {
+		for (int i = 3; i <= COUNT; i++)
+		{
+			buffer.Back() = i;
+			buffer.Publish();
+		}
+	});
+
+	int last = 2;
+	while (last != COUNT)
+	{
+		if (!buffer.Update())
+			continue;
+		EXPECT_GT(buffer.Front(), last);
+		last = buffer.Front();
+	}
+	writer.join();
+}
+
+TEST(LockstepRunnerTest, MatchesSeparateRuns)
+{
+	// calls the subroutine at 0x120 once for every button held, most of what
+	// it all runs is done in lockstep, the DAA, INC [HL] and SWAP A aren't
+	TestRom rom{ 0x31, 0xFE, 0xFF, 0x3E, 0x10, 0xE0, 0x00, 0xF0, 0x00, 0x2F, 0xE6, 0x0F, 0x47,
+		0x21, 0x00, 0xC0, 0x78, 0xB7, 0x28, 0x06, 0xCD, 0x20, 0x01, 0x05, 0x20, 0xFA,
+		0x34, 0xCB, 0x37, 0xC3, 0x07, 0x01,
+		0xC5, 0x2A, 0x87, 0x8F, 0x27, 0x22, 0x19, 0x13, 0x1A, 0x98, 0xFE, 0x40, 0x38, 0x01,
+		0x3D, 0x17, 0x1F, 0xEA, 0x10, 0xC1, 0xC1, 0xC9 };
+
+	LockstepRunner lockstep{ rom.path, 6 };
+	const uint8_t steps[4][6]{
+		{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+		{ 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 },
+		{ 0x10, 0x20, 0x30, 0x80, 0xF0, 0x10 },
+		{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+	};
+	for (int step = 0; step < 4; step++)
+		lockstep.Step(steps[step]);
+	if (CpuHasAVX2())
+	{
+		EXPECT_GT(lockstep.GetCounts().together, lockstep.GetCounts().steps / 2);
+	}
+
+	// every lane where it would be on its own
+	for (int lane = 0; lane < 6; lane++)
+	{
+		auto emu = std::make_unique<Emulator>();
+		emu->LoadGame(rom.path);
+		for (int step = 0; step < 4; step++)
+		{
+			emu->SetHeldButtons(steps[step][lane]);
+			emu->Update();
+		}
+		EXPECT_EQ(lockstep.GetLane(lane).GetStateHash(), emu->GetStateHash()) << lane;
+	}
+}
+
+TEST(RewindBufferTest, PopsBackInOrder)
+{
+	// a few bytes change each frame, like a game's RAM
+	constexpr size_t SIZE{ 4096 };
+	std::vector<std::vector<uint8_t>> states(300, std::vector<uint8_t>(SIZE));
+	for (size_t frame = 1; frame < states.size(); frame++)
+	{
+		states[frame] = states[frame - 1];
+		for (int i = 0; i < 20; i++)
+			states[frame][(frame * 131 + i * 977) % SIZE] += static_cast<uint8_t>(frame + i);
+	}
+
+	RewindBuffer rewind{ SIZE, 1 << 20, 16 };
+	for (const auto& state : states)
+		rewind.Push(state.data());
+	EXPECT_EQ(rewind.GetFrames(), states.size());
+	EXPECT_LT(rewind.GetBytesUsed(), states.size() * SIZE / 4);
+
+	std::vector<uint8_t> state(SIZE);
+	for (size_t frame = states.size(); frame-- > 0;)
+	{
+		ASSERT_TRUE(rewind.Pop(state.data()));
+		ASSERT_EQ(state, states[frame]) << frame;
+	}
+	EXPECT_FALSE(rewind.Pop(state.data()));
+
+	// too small for all of them, the newest are kept and still come out right
+	RewindBuffer small{ SIZE, 8192, 16 };
+	for (size_t frame = 0; frame < 200; frame++)
+		small.Push(states[frame].data());
+	EXPECT_GT(small.GetFrames(), 0u);
+	EXPECT_LT(small.GetFrames(), 200u);
+	EXPECT_LE(small.GetBytesUsed(), 8192u);
+
+	// and carry on from where they were popped to
+	for (size_t frame = 199; frame > 195; frame--)
+	{
+		ASSERT_TRUE(small.Pop(state.data()));
+		ASSERT_EQ(state, states[frame]) << frame;
+	}
+	for (size_t frame = 196; frame < 300; frame++)
+		small.Push(states[frame].data());
+	for (size_t frame = 299; small.Pop(state.data()); frame--)
+		ASSERT_EQ(state, states[frame]) << frame;
+}
+
+TEST(BatchRunnerTest, MatchesSeparateRuns)
+{
+	// the Movie program as a cartridge, reading the buttons into 0xC000
+	TestRom rom{ 0x3E, 0x10, 0xE0, 0x00, 0xF0, 0x00, 0xEA, 0x00, 0xC0, 0x18, 0xF5 };
+
+	// more instances than threads, each holding different buttons
+	BatchRunner batch{ rom.path, 7, 3 };
+	ASSERT_EQ(batch.GetInstanceCount(), 7);
+	ASSERT_EQ(batch.GetThreadCount(), 3);
+	std::vector<uint8_t> buttons(7);
+	for (int step = 0; step < 4; step++)
+	{
+		for (int i = 0; i < 7; i++)
+			buttons[i] = static_cast<uint8_t>((i + step) << 4);
+		batch.Step(buttons.data(), 2);
+	}
+	batch.Step(nullptr);
+
+	for (int i = 0; i < 7; i++)
+	{
+		auto emu = std::make_unique<Emulator>();
+		emu->LoadGame(rom.path);
+		for (int step = 0; step < 4; step++)
+		{
+			emu->SetHeldButtons(static_cast<uint8_t>((i + step) << 4));
+			emu->Update();
+			emu->Update();
+		}
+		emu->Update();
+		EXPECT_EQ(batch.GetInstance(i).GetStateHash(), emu->GetStateHash()) << i;
+	}
+}
+
+TEST(GymEnvTest, StepsAndObserves)
+{
+	// blackens tile 0, which the whole background shows, then reads the buttons into 0xC000
+	TestRom rom{ 0x3E, 0xFF, 0x21, 0x00, 0x80, 0x06, 0x10, 0x22, 0x05, 0x20, 0xFC,
+		0x3E, 0x10, 0xE0, 0x00, 0xF0, 0x00, 0xEA, 0x00, 0xC0, 0x18, 0xF5 };
+
+	GymEnv screen{ rom.path };
+	ASSERT_EQ(screen.GetObservationSize(), 84u * 84u);
+	std::vector<uint8_t> observation(screen.GetObservationSize());
+	screen.Reset(observation.data());
+	EXPECT_TRUE(std::all_of(observation.begin(), observation.end(), [](uint8_t grey) { return grey == 0xFF; }));
+
+	// line 0 is never drawn, the rest is black
+	screen.Step(0, 2, observation.data());
+	EXPECT_TRUE(std::all_of(observation.begin() + 84, observation.end(), [](uint8_t grey) { return grey == 0; }));
+
+	// frames before the last aren't drawn, but ending on the second of 4
+	// still shows that frame, drawn again from its start
+	std::vector<VideoMode> modes;
+	uint64_t endHash = 0;
+	screen.SetDoneHook([&](const Emulator& emu) {
+		modes.push_back(emu.GetVideoMode());
+		endHash = emu.GetStateHash();
+		return modes.size() == 2;
+	});
+	screen.Reset(observation.data());
+	EXPECT_TRUE(screen.Step(0, 4, observation.data()).done);
+	EXPECT_EQ(modes, std::vector<VideoMode>(2, VideoMode::TIMING_ONLY));
+	EXPECT_EQ(screen.GetEmulator().GetStateHash(), endHash);
+	EXPECT_TRUE(std::all_of(observation.begin() + 84, observation.end(), [](uint8_t grey) { return grey == 0; }));
+
+	// a point for every frame with a button down, over after 6 frames
+	GymEnv ram{ rom.path, { ObservationKind::RAM, 0, 0, 0xC000, 4 } };
+	ASSERT_EQ(ram.GetObservationSize(), 4u);
+	ram.SetRewardHook([](const Emulator& emu) { return (emu.PeekMemory(0xC000) & 0x0F) != 0x0F ? 1.0f : 0.0f; });
+	int frames = 0;
+	ram.SetDoneHook([&frames](const Emulator&) { return ++frames == 6; });
+	observation.resize(4);
+	ram.Reset(observation.data());
+
+	GymEnv::StepResult result = ram.Step(0, 2, observation.data());
+	EXPECT_EQ(result.reward, 0.0f);
+	EXPECT_FALSE(result.done);
+	EXPECT_EQ(observation[0] & 0x0F, 0x0F);
+
+	// A held, then only 2 of the 4 frames before the end
+	result = ram.Step(1 << 4, 2, observation.data());
+	EXPECT_EQ(result.reward, 2.0f);
+	EXPECT_EQ(observation[0] & 0x01, 0);
+	result = ram.Step(1 << 4, 4, observation.data());
+	EXPECT_EQ(result.reward, 2.0f);
+	EXPECT_TRUE(result.done);
+
+	// and again from the start
+	frames = 0;
+	ram.Reset(observation.data());
+	EXPECT_EQ(ram.GetEmulator().GetCycleCount(), 0u);
+	EXPECT_EQ(ram.Step(0, 1, observation.data()).reward, 0.0f);
+}
+
 int main(int argc, char** argv)
 {
 	::testing::InitGoogleTest(&argc, argv);
 
 	return RUN_ALL_TESTS();
-}
\ No newline at end of file
+}